@@ -0,0 +1,567 @@
+// Microbenchmarks of the Bicycle task, replayed on mjData states recorded from each scene
+//
+//   bicycle_benchmark --record --scenes=straight,track        records <corpus_dir>/<scene>.state
+//   bicycle_benchmark --scenes=straight,track --threads=8     times the task functions on 1..8 threads
+//   bicycle_benchmark --planner --samples=10,30,100           times full planner iterations
+//
+// Every mode prints one CSV table. Timing the task functions exits with 1 when the residual,
+// the closest point or the curve reads allocate
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_split.h>
+#include <mujoco/mujoco.h>
+
+#include "mjpc/agent.h"
+#include "mjpc/tasks/bicycle/bicycle.h"
+#include "mjpc/tasks/bicycle/runner.h"
+#include "mjpc/threadpool.h"
+#include "mjpc/utilities.h"
+
+ABSL_FLAG(std::string, output_file, "/dev/null", "Time series written by the task, not needed here");
+ABSL_FLAG(std::string, scenes, "straight,zigzag,track,stairs,rough", "Comma separated scenes");
+ABSL_FLAG(std::string, corpus_dir, ".", "Directory of the recorded <scene>.state files");
+ABSL_FLAG(bool, record, false, "Record the state corpus of each scene instead of timing");
+ABSL_FLAG(double, record_time, 30, "Simulation seconds recorded per scene");
+ABSL_FLAG(int, record_every, 5, "Steps between recorded states");
+ABSL_FLAG(int, threads, 0, "Largest thread count timed, 0 for all available");
+ABSL_FLAG(int, reps, 100, "Calls per recorded state");
+ABSL_FLAG(bool, planner, false, "Time full planner iterations instead of the task functions");
+ABSL_FLAG(std::string, samples, "10,30,100", "Comma separated sampling_trajectories timed by --planner");
+
+// Counts heap allocations per thread, so a benchmark can report allocations per call
+namespace
+{
+    thread_local uint64_t allocations = 0;
+}
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    // States of one scene in episode order, each with the path progress the task had there
+    //   char[4] "BCSC", uint32 version, uint32 state spec, uint32 state size, uint32 count,
+    //   then count records of (progress, state...) as float64
+    struct Corpus
+    {
+        unsigned int spec = mjSTATE_INTEGRATION;
+        int size = 0;
+        std::vector<double> records;
+
+        int count() const { return size ? records.size() / (size + 1) : 0; }
+        double progress(int k) const { return records[k * (size + 1)]; }
+        const double *state(int k) const { return &records[k * (size + 1) + 1]; }
+    };
+
+    constexpr uint32_t kCorpusVersion = 1;
+
+    std::string CorpusPath(const std::string &scene)
+    {
+        return absl::GetFlag(FLAGS_corpus_dir) + "/" + scene + ".state";
+    }
+
+    bool SaveCorpus(const std::string &file, const Corpus &corpus)
+    {
+        FILE *f = std::fopen(file.c_str(), "wb");
+        if (!f)
+            return false;
+        uint32_t header[4] = {kCorpusVersion, corpus.spec, (uint32_t)corpus.size, (uint32_t)corpus.count()};
+        std::fwrite("BCSC", 1, 4, f);
+        std::fwrite(header, sizeof(uint32_t), 4, f);
+        std::fwrite(corpus.records.data(), sizeof(double), corpus.records.size(), f);
+        return std::fclose(f) == 0;
+    }
+
+    bool LoadCorpus(const std::string &file, const mjModel *model, Corpus *corpus)
+    {
+        FILE *f = std::fopen(file.c_str(), "rb");
+        if (!f)
+            return false;
+        char magic[4];
+        uint32_t header[4];
+        bool ok = std::fread(magic, 1, 4, f) == 4 && std::memcmp(magic, "BCSC", 4) == 0 &&
+                  std::fread(header, sizeof(uint32_t), 4, f) == 4 && header[0] == kCorpusVersion &&
+                  (int)header[2] == mj_stateSize(model, header[1]);
+        if (ok)
+        {
+            corpus->spec = header[1];
+            corpus->size = header[2];
+            corpus->records.resize((size_t)header[3] * (corpus->size + 1));
+            ok = std::fread(corpus->records.data(), sizeof(double), corpus->records.size(), f) == corpus->records.size();
+        }
+        std::fclose(f);
+        return ok && corpus->count() > 0;
+    }
+
+    Corpus Record(mjModel *model, mjpc::ThreadPool *pool)
+    {
+        Corpus corpus;
+        corpus.size = mj_stateSize(model, corpus.spec);
+        auto task = std::make_shared<mjpc::Bicycle>("", absl::GetFlag(FLAGS_output_file));
+        task->print_metrics = false;
+        int step = 0;
+        int every = std::max(absl::GetFlag(FLAGS_record_every), 1);
+        mjpc::RunEpisode(model, task, pool, absl::GetFlag(FLAGS_record_time),
+                         [&](const mjModel *m, const mjData *d) {
+                             if (step++ % every)
+                                 return;
+                             size_t k = corpus.records.size();
+                             corpus.records.resize(k + corpus.size + 1);
+                             corpus.records[k] = task->current_t;
+                             mj_getState(m, d, &corpus.records[k + 1], corpus.spec);
+                         });
+        return corpus;
+    }
+
+    struct Result
+    {
+        uint64_t calls = 0;
+        double seconds = 0;
+        uint64_t allocations = 0;
+        double throughput = 0; // Calls per second summed over the threads
+    };
+
+    Result Sum(const std::vector<Result> &results)
+    {
+        Result total;
+        for (const Result &r : results)
+        {
+            total.calls += r.calls;
+            total.seconds += r.seconds;
+            total.allocations += r.allocations;
+            total.throughput += r.seconds > 0 ? r.calls / r.seconds : 0;
+        }
+        return total;
+    }
+
+    // Runs reps calls per recorded state on each thread, timing only the calls. make_call(data)
+    // builds the per-thread call; the call receives the state index, data already holds that state.
+    template <typename MakeCall>
+    Result Time(const mjModel *model, const Corpus &corpus, int threads, int reps, MakeCall make_call)
+    {
+        std::vector<Result> results(threads);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; i++)
+        {
+            workers.emplace_back([&, i]() {
+                mjData *data = mj_makeData(model);
+                auto call = make_call(data);
+                Result &r = results[i];
+                for (int k = 0; k < corpus.count(); k++)
+                {
+                    mj_setState(model, data, corpus.state(k), corpus.spec);
+                    mj_forward(model, data);
+                    uint64_t a0 = allocations;
+                    Clock::time_point t0 = Clock::now();
+                    for (int j = 0; j < reps; j++)
+                        call(k);
+                    r.seconds += std::chrono::duration<double>(Clock::now() - t0).count();
+                    r.allocations += allocations - a0;
+                    r.calls += reps;
+                }
+                mj_deleteData(data);
+            });
+        }
+        for (std::thread &worker : workers)
+            worker.join();
+
+        return Sum(results);
+    }
+
+    // The whole corpus as one batch per thread, reps times; a call is one state
+    Result TimeBatch(const mjModel *model, const Corpus &corpus, int threads, int reps, const mjpc::Bicycle &task)
+    {
+        std::vector<Result> results(threads);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; i++)
+        {
+            workers.emplace_back([&, i]() {
+                mjData *data = mj_makeData(model);
+                mjpc::Bicycle::StateBatch batch;
+                batch.resize(corpus.count());
+                for (int k = 0; k < corpus.count(); k++)
+                {
+                    mj_setState(model, data, corpus.state(k), corpus.spec);
+                    mj_forward(model, data);
+                    task.GatherState(&batch, k, model, data);
+                }
+                std::vector<double> residual(corpus.count() * task.num_residual);
+
+                Result &r = results[i];
+                uint64_t a0 = allocations;
+                Clock::time_point t0 = Clock::now();
+                for (int j = 0; j < reps; j++)
+                    task.ResidualBatch(batch, residual.data());
+                r.seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+                r.allocations = allocations - a0;
+                r.calls = (uint64_t)reps * corpus.count();
+                mj_deleteData(data);
+            });
+        }
+        for (std::thread &worker : workers)
+            worker.join();
+
+        return Sum(results);
+    }
+
+    // Functions of the residual path that must not touch the heap, checked after every run
+    constexpr const char *kNoAllocations[] = {"residual", "residual_batch", "closest_point", "get_points_batch",
+                                                "get_curve"};
+    bool allocation_failure = false;
+
+    void PrintResult(const std::string &scene, const char *function, int threads, const Result &r)
+    {
+        if (r.allocations && std::find_if(std::begin(kNoAllocations), std::end(kNoAllocations), [&](const char *f) {
+                                 return std::strcmp(f, function) == 0;
+                             }) != std::end(kNoAllocations))
+        {
+            std::fprintf(stderr, "%s: %s made %llu heap allocations in %llu calls\n", scene.c_str(), function,
+                         (unsigned long long)r.allocations, (unsigned long long)r.calls);
+            allocation_failure = true;
+        }
+        std::printf("%s,%s,%d,%llu,%.1f,%.3f,%.0f\n", scene.c_str(), function, threads,
+                    (unsigned long long)r.calls, r.calls ? 1e9 * r.seconds / r.calls : 0.0,
+                    r.calls ? (double)r.allocations / r.calls : 0.0, r.throughput);
+    }
+
+    // Path field against the exact projection over the corpus, on stderr so the table stays CSV.
+    // Only lookups the Field target accepts are compared, the others project anyway
+    void CompareField(const mjModel *model, const std::string &scene, const Corpus &corpus, const mjpc::Bicycle &task)
+    {
+        const PathField *field = task.getPathField();
+        const Path *path = task.getPath();
+        mjData *data = mj_makeData(model);
+        int hits = 0;
+        double error_sum = 0, error_max = 0, angle_max = 0;
+        for (int k = 0; k < corpus.count(); k++)
+        {
+            mj_setState(model, data, corpus.state(k), corpus.spec);
+            mj_forward(model, data);
+            double q[3], t, tangent[3], distance, field_t, dir[3];
+            const double t_max = task.getProjectionEnd(corpus.progress(k));
+            double exact = mjpc::getClosestPoint(q, &t, data, task.getSensors(), path, corpus.progress(k), t_max);
+            if (!field->lookup(data->sensordata + task.getSensors().track_pos, &distance, &field_t, dir) ||
+                field_t < corpus.progress(k) || field_t > t_max)
+                continue;
+            path->getTangent(tangent, t);
+            double error = std::abs(distance - exact);
+            hits++;
+            error_sum += error;
+            error_max = std::max(error_max, error);
+            angle_max = std::max(angle_max, std::acos(std::clamp(mju_dot3(tangent, dir), -1.0, 1.0)));
+        }
+        mj_deleteData(data);
+        std::fprintf(stderr, "%s: path field of %d nodes answers %d of %d states, distance error mean %.2g m "
+                             "max %.2g m, tangent error max %.2f deg\n",
+                     scene.c_str(), field->getNumNodes(), hits, corpus.count(), hits ? error_sum / hits : 0.0,
+                     error_max, angle_max * 180 / mjPI);
+    }
+
+    // Warm-started projection (each state from the parameter of the state before) against the cold
+    // search over the corpus, on stderr. Counts results more than 1 mm apart
+    void CompareTracking(const mjModel *model, const std::string &scene, const Corpus &corpus,
+                         const mjpc::Bicycle &task)
+    {
+        const Path *path = task.getPath();
+        mjData *data = mj_makeData(model);
+        int mismatches = 0, warm_iterations = 0, cold_iterations = 0;
+        double error_max = 0, t_previous = -1;
+        for (int k = 0; k < corpus.count(); k++)
+        {
+            mj_setState(model, data, corpus.state(k), corpus.spec);
+            mj_forward(model, data);
+            const double *p = data->sensordata + task.getSensors().track_pos;
+            const double t_max = task.getProjectionEnd(corpus.progress(k));
+            double q[3], t, cold_t;
+            double warm = mjpc::trackClosestPoint(q, &t, p, path, corpus.progress(k), t_max, t_previous,
+                                                  &warm_iterations);
+            double cold = path->project(q, &cold_t, p, corpus.progress(k), t_max, &cold_iterations);
+            mismatches += std::abs(warm - cold) > 1e-3;
+            error_max = std::max(error_max, std::abs(warm - cold));
+            t_previous = t;
+        }
+        mj_deleteData(data);
+        std::fprintf(stderr, "%s: warm-started projection differs from the cold one on %d of %d states (max %.2g m), "
+                             "%d against %d Newton iterations\n",
+                     scene.c_str(), mismatches, corpus.count(), error_max, warm_iterations, cold_iterations);
+    }
+
+    // Keeps the reads of get_curve from being optimised away
+    volatile double sink = 0;
+
+    // Parameters spread over the whole route, for the point evaluation cases
+    constexpr int kBatch = 64;
+    struct Batch
+    {
+        explicit Batch(const Path &path) : t(kBatch), xyz(3 * kBatch)
+        {
+            const double start = path.getFirstAnchor(), end = path.getNumAnchors() - 1.0;
+            for (int i = 0; i < kBatch; i++)
+                t[i] = start + (end - start) * i / (kBatch - 1);
+        }
+        std::vector<double> t, xyz;
+    };
+
+    void BenchmarkTask(mjModel *model, const std::string &scene, const Corpus &corpus, int max_threads, int reps)
+    {
+        auto task = std::make_shared<mjpc::Bicycle>("", absl::GetFlag(FLAGS_output_file));
+        task->print_metrics = false;
+        task->Reset(model);
+        const mjpc::Bicycle *reader = task.get();
+        const Path *path = reader->getPath();
+
+        // Read-only functions, timed on powers of two threads up to max_threads
+        std::vector<int> counts;
+        for (int threads = 1; threads < max_threads; threads *= 2)
+            counts.push_back(threads);
+        counts.push_back(max_threads);
+
+        // Residual functions copy the progress published when they are made, so one per state,
+        // each with the progress recorded there. They are only read, the threads share them
+        std::vector<std::unique_ptr<mjpc::ResidualFn>> residuals;
+        mjData *data = mj_makeData(model);
+        for (int k = 0; k < corpus.count(); k++)
+        {
+            mj_setState(model, data, corpus.state(k), corpus.spec);
+            task->SetProgress(corpus.progress(k), data->time);
+            residuals.push_back(reader->Residual());
+        }
+        mj_deleteData(data);
+        task->SetProgress(corpus.progress(0), 0);
+
+        for (int threads : counts)
+        {
+            PrintResult(scene, "residual", threads, Time(model, corpus, threads, reps, [&](mjData *data) {
+                return [data, model, &residuals, residual = std::vector<double>(reader->num_residual)](int k) mutable {
+                    residuals[k]->Residual(model, data, residual.data());
+                };
+            }));
+            PrintResult(scene, "residual_batch", threads, TimeBatch(model, corpus, threads, reps, *reader));
+            PrintResult(scene, "closest_point", threads, Time(model, corpus, threads, reps, [&](mjData *data) {
+                return [data, path, reader, &corpus, sensors = reader->getSensors()](int k) {
+                    double q[3], t;
+                    mjpc::getClosestPoint(q, &t, data, sensors, path, corpus.progress(k),
+                                          reader->getProjectionEnd(corpus.progress(k)));
+                };
+            }));
+            if (const PathField *field = reader->getPathField())
+                PrintResult(scene, "field_lookup", threads, Time(model, corpus, threads, reps, [&](mjData *data) {
+                    return [data, field, sensors = reader->getSensors()](int) {
+                        double distance, t, dir[3];
+                        field->lookup(data->sensordata + sensors.track_pos, &distance, &t, dir);
+                    };
+                }));
+            PrintResult(scene, "get_point", threads, Time(model, corpus, threads, reps, [&](mjData *) {
+                return [path, t = 0.0, end = path->getNumAnchors() - 1.0](int) mutable {
+                    double p[3];
+                    path->getPoint(p, t);
+                    t = t + 0.37 < end ? t + 0.37 : 0;
+                };
+            }));
+            // The same kBatch parameters one point at a time and through the batch kernel
+            PrintResult(scene, "get_point_batch", threads, Time(model, corpus, threads, reps, [&](mjData *) {
+                return [path, batch = Batch(*path)](int) mutable {
+                    double p[3];
+                    for (int i = 0; i < kBatch; i++)
+                    {
+                        path->getPoint(p, batch.t[i]);
+                        batch.xyz[i] = p[0];
+                    }
+                };
+            }));
+            PrintResult(scene, "get_points_batch", threads, Time(model, corpus, threads, reps, [&](mjData *) {
+                return [path, batch = Batch(*path)](int) mutable {
+                    path->getPoints(batch.xyz.data(), batch.xyz.data() + kBatch, batch.xyz.data() + 2 * kBatch,
+                                    batch.t.data(), kBatch);
+                };
+            }));
+            PrintResult(scene, "get_curve", threads, Time(model, corpus, threads, reps, [&](mjData *) {
+                return [path](int) {
+                    double sum = 0;
+                    for (double v : path->getCurve())
+                        sum += v;
+                    sink = sum;
+                };
+            }));
+        }
+
+        if (reader->getPathField())
+            CompareField(model, scene, corpus, *reader);
+        CompareTracking(model, scene, corpus, *reader);
+
+        // Functions that change the task or the path, on one thread. Transitions replay the
+        // states in episode order, so the progress moves forward as it did when recording.
+        task->Reset(model);
+        PrintResult(scene, "transition", 1, Time(model, corpus, 1, reps, [&](mjData *data) {
+            return [data, model, &task](int) { task->TransitionLocked(model, data); };
+        }));
+
+        mjvScene scn;
+        mjv_defaultScene(&scn);
+        mjv_makeScene(model, &scn, 10000);
+        // The progress of each state, so the overlay is rebuilt as often as in the episode
+        auto progress = [&task, path](double t) {
+            task->current_t = t;
+            task->current_point_i = path->getSampleIndex(t);
+            task->current_s = path->getArcLength(t);
+        };
+        PrintResult(scene, "modify_scene", 1, Time(model, corpus, 1, reps, [&](mjData *data) {
+            return [data, model, &task, &scn, &corpus, progress](int k) {
+                progress(corpus.progress(k));
+                scn.ngeom = 0;
+                task->ModifyScene(model, data, &scn);
+            };
+        }));
+        // Every other call jumps half the route away from the state, so every call rebuilds the overlay
+        PrintResult(scene, "modify_scene_rebuild", 1, Time(model, corpus, 1, reps, [&](mjData *data) {
+            return [data, model, &task, &scn, &corpus, progress, path](int k) {
+                const double first = path->getFirstAnchor(), span = path->getNumAnchors() - 1 - first;
+                double t = corpus.progress(k / 2 * 2);
+                if (k % 2)
+                    t = first + std::fmod(t - first + span / 2, span);
+                progress(t);
+                scn.ngeom = 0;
+                task->ModifyScene(model, data, &scn);
+            };
+        }));
+        mjv_freeScene(&scn);
+
+        // Rebuild the whole route one anchor at a time, reps times
+        Result add;
+        for (int r = 0; r < reps; r++)
+        {
+            Path copy(path->getNumSegments());
+            uint64_t a0 = allocations;
+            Clock::time_point t0 = Clock::now();
+            for (int i = 0; i < path->getNumAnchors(); i++)
+            {
+                double p[9];
+                path->getAnchor(p, i);
+                path->getLeftControl(p + 3, i);
+                path->getRightControl(p + 6, i);
+                copy.addPoint(p);
+            }
+            add.seconds += std::chrono::duration<double>(Clock::now() - t0).count();
+            add.allocations += allocations - a0;
+            add.calls += path->getNumAnchors();
+        }
+        add.throughput = add.calls / add.seconds;
+        PrintResult(scene, "add_point", 1, add);
+    }
+
+    // One planner iteration per recorded state, at each sampling_trajectories value. Allocations
+    // are only counted on this thread, the rollouts run on the pool.
+    void BenchmarkPlanner(const mjModel *base, const std::string &scene, const Corpus &corpus, mjpc::ThreadPool *pool)
+    {
+        std::vector<std::string> samples = absl::StrSplit(absl::GetFlag(FLAGS_samples), ',', absl::SkipWhitespace());
+        for (const std::string &value : samples)
+        {
+            mjModel *model = mj_copyModel(nullptr, base);
+            char error[1024] = "";
+            if (!mjpc::ApplyOverrides(model, {{"sampling_trajectories", std::strtod(value.c_str(), nullptr)}}, error, sizeof(error)))
+                mju_error("%s", error);
+
+            auto task = std::make_shared<mjpc::Bicycle>("", absl::GetFlag(FLAGS_output_file));
+            task->print_metrics = false;
+            mjpc::Agent agent;
+            mjpc::InitializeAgent(&agent, model, task);
+
+            Result r;
+            mjData *data = mj_makeData(model);
+            for (int k = 0; k < corpus.count(); k++)
+            {
+                mj_setState(model, data, corpus.state(k), corpus.spec);
+                mj_forward(model, data);
+                task->SetProgress(corpus.progress(k), data->time);
+                agent.ActiveState().Set(model, data);
+                uint64_t a0 = allocations;
+                Clock::time_point t0 = Clock::now();
+                agent.PlanIteration(pool);
+                r.seconds += std::chrono::duration<double>(Clock::now() - t0).count();
+                r.allocations += allocations - a0;
+                r.calls++;
+            }
+            r.throughput = r.calls / r.seconds;
+            std::printf("%s,%s,%d,%llu,%.3f,%.1f,%.2f\n", scene.c_str(), value.c_str(), pool->NumThreads(),
+                        (unsigned long long)r.calls, 1e3 * r.seconds / r.calls, (double)r.allocations / r.calls,
+                        r.throughput);
+            mj_deleteData(data);
+            mj_deleteModel(model);
+        }
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    absl::ParseCommandLine(argc, argv);
+    std::vector<std::string> scenes = absl::StrSplit(absl::GetFlag(FLAGS_scenes), ',', absl::SkipWhitespace());
+    int threads = absl::GetFlag(FLAGS_threads);
+    if (threads <= 0)
+        threads = mjpc::NumAvailableHardwareThreads();
+    mjpc::ThreadPool pool(threads);
+
+    if (absl::GetFlag(FLAGS_planner))
+        std::printf("scene,trajectories,threads,iterations,ms_per_iteration,allocations_per_iteration,iterations_per_second\n");
+    else if (!absl::GetFlag(FLAGS_record))
+        std::printf("scene,function,threads,calls,ns_per_call,allocations_per_call,calls_per_second\n");
+
+    for (const std::string &scene : scenes)
+    {
+        char error[1024] = "";
+        mjModel *model = mjpc::LoadBicycleModel(scene, error, sizeof(error));
+        if (!model)
+        {
+            std::fprintf(stderr, "Failed to load scene %s: %s\n", scene.c_str(), error);
+            return 1;
+        }
+
+        Corpus corpus;
+        if (absl::GetFlag(FLAGS_record))
+        {
+            corpus = Record(model, &pool);
+            if (!SaveCorpus(CorpusPath(scene), corpus))
+            {
+                std::fprintf(stderr, "Failed to write %s\n", CorpusPath(scene).c_str());
+                return 1;
+            }
+            std::printf("%s: %d states\n", CorpusPath(scene).c_str(), corpus.count());
+        }
+        else if (!LoadCorpus(CorpusPath(scene), model, &corpus))
+        {
+            std::fprintf(stderr, "No corpus for %s in %s, run with --record first\n", scene.c_str(),
+                         CorpusPath(scene).c_str());
+            return 1;
+        }
+        else if (absl::GetFlag(FLAGS_planner))
+            BenchmarkPlanner(model, scene, corpus, &pool);
+        else
+            BenchmarkTask(model, scene, corpus, threads, absl::GetFlag(FLAGS_reps));
+
+        mj_deleteModel(model);
+    }
+    return allocation_failure ? 1 : 0;
+}
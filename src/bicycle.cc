@@ -1,8 +1,15 @@
 #include "mjpc/tasks/bicycle/bicycle.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <filesystem>
 #include <string>
 #include <format>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <vector>
 #include <fstream>
 
 #include <mujoco/mujoco.h>
@@ -11,13 +18,21 @@
 #include "absl/flags/declare.h"
 #include "mjpc/task.h"
 #include "mjpc/utilities.h"
-#include "mjpc/simulate.h"
-#include "GLFW/glfw3.h"
+#include "mjpc/tasks/bicycle/reduced_rider.h"
 #include "path.h"
+#include "residual.h"
 
-ABSL_DECLARE_FLAG(std::string, output_file);
+#ifndef MJPC_BICYCLE_HEADLESS
+#include "GLFW/glfw3.h"
+#endif
 
-extern std::unique_ptr<mujoco::Simulate> sim;
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+ABSL_DECLARE_FLAG(std::string, output_file);
 
 namespace mjpc
 {
@@ -39,32 +54,82 @@ namespace mjpc
 
     std::string Bicycle::Name() const { return "Bicycle"; }
 
-    Bicycle::Bicycle() : residual_(this) {
-        path_ = new Path(50);
+    namespace
+    {
+        // Synergy bases of the planning models tasks were reset with. The control callback reads
+        // them in every step of every thread; ResetLocked and the task destructor write them, and
+        // install or restore the callback, under the lock
+        struct SynergyModel
+        {
+            const Bicycle *task;
+            const mjModel *model;
+            int nu, nv; // Of model, so another model later allocated at its address does not match
+            int actuators[SynergyBasis::kSynergies];
+            SynergyBasis basis;
+        };
+        std::shared_mutex synergy_mutex;
+        std::vector<std::unique_ptr<const SynergyModel>> synergy_models;
+        mjfGeneric replaced_control = nullptr; // Restored when the last synergy model goes
+
+        void AddSynergyModel(const Bicycle *task, const mjModel *model, const int actuators[SynergyBasis::kSynergies])
+        {
+            auto entry = std::unique_ptr<const SynergyModel>(new SynergyModel{
+                task, model, model->nu, model->nv, {actuators[0], actuators[1], actuators[2]}, SynergyBasis(model)});
+            if (!entry->basis.AppliesMotors())
+                mju_error("Bicycle: the synergy model lists no synergy_motor_ joints");
+            std::unique_lock lock(synergy_mutex);
+            std::erase_if(synergy_models, [model](const auto &s) { return s->model == model; });
+            if (mjcb_control != &Bicycle::ExpandSynergies)
+            {
+                replaced_control = mjcb_control;
+                mjcb_control = &Bicycle::ExpandSynergies;
+            }
+            synergy_models.push_back(std::move(entry));
+        }
+
+        void RemoveSynergyModels(const Bicycle *task)
+        {
+            std::unique_lock lock(synergy_mutex);
+            std::erase_if(synergy_models, [task](const auto &s) { return s->task == task; });
+            if (synergy_models.empty() && mjcb_control == &Bicycle::ExpandSynergies)
+            {
+                mjcb_control = replaced_control;
+                replaced_control = nullptr;
+            }
+        }
+    } // namespace
 
-        // Load points from csv (9 doubles per line)
-        std::string path_csv = "mjpc/tasks/bicycle/experiments/path.csv";
-        int res = path_->loadFromFile(path_csv);
-        if (res != 0)
-            mju_error("Failed to load path from %s", path_csv.c_str());
+    Bicycle::Bicycle(const std::string &path_file, const std::string &output_file)
+        : residual_(this), path_file_(path_file) {
+        path_ = std::make_shared<Path>(50);
+        if (!path_file_.empty())
+            LoadRoute(path_file_);
 
-        metrics = new Metrics(path_->getCurve().size() / 3);
+        metrics = new Metrics(path_->getNumPoints());
 
-        std::string outfile = absl::GetFlag(FLAGS_output_file);
+        std::string outfile = output_file.empty() ? absl::GetFlag(FLAGS_output_file) : output_file;
         out.open(outfile, std::ios::binary);
         if (!out.good())
             mju_error("Failed to open output file %s", outfile.c_str());
+        metrics->openTimeSeries(out);
+
+        telemetry_thread_ = std::thread(&Bicycle::TelemetryLoop, this);
     }
 
     Bicycle::~Bicycle()
     {
-        delete path_;
+        telemetry_stop_.store(true, std::memory_order_release);
+        telemetry_thread_.join();
+        RemoveSynergyModels(this);
         delete metrics;
         out.close();
     }
 
     int GetVelocityGoal(mjtNum *vel, mjtNum *head)
     {
+#ifdef MJPC_BICYCLE_HEADLESS
+        return 0;
+#else
         int count;
         const float *axes = glfwGetJoystickAxes(GLFW_JOYSTICK_1, &count);
         if (count < 5)
@@ -84,321 +149,651 @@ namespace mjpc
             vel[2] = 0;
         }
         return 1;
+#endif
     }
 
-    void ActionResidual(const mjModel *model, const mjData *data, double *residual, int *counter)
+    // Residual terms ------------------------------------------------------------------------------------------------
+    // Everything a term reads, built once per Residual call
+    struct ResidualContext
     {
-        int humanoid_controls = 21;
-        mjtNum *start = data->ctrl + model->nu - humanoid_controls;
-        mju_copy(&residual[*counter], start, humanoid_controls);
-        *counter += humanoid_controls;
-    }
-
-    void PoseResidual(const mjModel *model, const mjData *data, double *residual, int *counter)
+        const mjModel *model;
+        const mjData *data;
+        const Bicycle::SensorTable &sensors;
+        const std::vector<double> &parameters;
+        const Bicycle::Progress &progress; // Snapshot of the residual function, not the live task
+        const Bicycle *task;
+        TaskStats &stats;
+    };
+
+    struct ActionTerm
     {
-        // Arms are at last 6 positions of qpos
-        mjtNum arms[6] = {0.477525, -0.31974, -0.750274, 0.477525, -0.31974, -0.750274};
-        mjtNum arms_error[6];
-        mju_sub(arms_error, data->qpos + model->nq - 6, arms, 6);
-        mju_copy(&residual[*counter], arms_error, 6);
-        *counter += 6;
-
-        // Abdomen is at last model-nq - 21 to model-nq - 18
-        mjtNum abdomen[3] = {0.0, -0.26, 0.0};
-        mjtNum abdomen_error[3];
-        mju_sub(abdomen_error, data->qpos + model->nq - 21, abdomen, 3);
-        mju_copy(&residual[*counter], abdomen_error, 3);
-        *counter += 3;
-    }
+        static constexpr int kDim = Bicycle::kHumanoidControls;
+        static constexpr const char *kName = "Action";
+        static void Compute(const ResidualContext &ctx, double *residual)
+        {
+            TaskStats::Timer timer(ctx.stats, kStatActionNs);
+            // A reduced planning model has fewer controls, they fill the end of the term
+            const int nu = std::min(ctx.model->nu, kDim);
+            mju_zero(residual, kDim - nu);
+            mju_copy(residual + kDim - nu, ctx.data->ctrl + ctx.model->nu - nu, nu);
+        }
+    };
 
-    void VelocityResidual(const mjModel *model, const mjData *data, double *residual, int *counter,
-        const std::vector<double> &parameters_)
+    struct BalanceTerm
     {
-        double speed_goal = parameters_[0];
-        double heading_goal = -parameters_[1]; // In radians [-pi, pi]
+        static constexpr int kDim = 1;
+        static constexpr const char *kName = "Balance";
+        static void Compute(const ResidualContext &ctx, double *residual)
+        {
+            const mjtNum *up_axis = ctx.data->sensordata + ctx.sensors.bicycle_yaxis;
+            residual[0] = up_axis[2] - 1.0;
+        }
+    };
 
-        double target_velocity[3] = {speed_goal * cos(heading_goal),
-                                     speed_goal * sin(heading_goal), 0};
+    // The bicycle should reach the goal position at a certain speed and heading, needs the goal sensors
+    struct GoalTerm
+    {
+        static constexpr int kDim = 2;
+        static constexpr const char *kName = "Goal";
+        static void Compute(const ResidualContext &ctx, double *residual)
+        {
+            const mjtNum *goal_pos = ctx.data->sensordata + ctx.sensors.goal_pos;
+            const mjtNum *bicycle_pos = ctx.data->sensordata + ctx.sensors.bicycle_pos;
+
+            mjtNum goal_displacement[3];
+            mju_sub3(goal_displacement, goal_pos, bicycle_pos);
+            goal_displacement[2] = 0; // Ignore the z-axis
+            residual[0] = mju_norm3(goal_displacement);
+
+            mjtNum goal_speed = ctx.parameters[0];
+            const mjtNum *goal_xaxis = ctx.data->sensordata + ctx.sensors.goal_zaxis;
+            mjtNum goal_velocity[3];
+            mju_scl3(goal_velocity, goal_xaxis, goal_speed);
+            const mjtNum *bicycle_velocity = ctx.data->sensordata + ctx.sensors.frame_subtreelinvel;
+            mjtNum velocity_error[3];
+            mju_sub3(velocity_error, goal_velocity, bicycle_velocity);
+            residual[1] = mju_norm3(velocity_error);
+        }
+    };
 
-        GetVelocityGoal(target_velocity, nullptr);
+    // Meters around the route covered by its path field
+    constexpr double kFieldMargin = 3;
 
-        double *currect_velocity = SensorByName(model, data, "frame_subtreelinvel");
-        double velocity_error[3];
-        mju_sub3(velocity_error, target_velocity, currect_velocity);
-        double velocity_error_norm = mju_norm3(velocity_error);
-        residual[(*counter)++] = velocity_error_norm;
+    // Projects the tracked site onto the path, never behind current_t
+    double getClosestPoint(double closest_point[3], double *t, const mjData *data,
+        const Bicycle::SensorTable &sensors, const Path *path, const double current_t, const double t_max,
+        int *iterations)
+    {
+        // mjtNum *bicycle_pos = data->sensordata + sensors.bicycle_pos;
+        mjtNum *bicycle_pos = data->sensordata + sensors.track_pos;
+        return path->project(closest_point, t, bicycle_pos, current_t, t_max, iterations);
     }
 
-    void BalanceResidual(const mjModel *model, const mjData *data, double *residual, int *counter)
+    // Warm starts search [t_previous - kTrackingSlack, t_previous + kTrackingWindow] first
+    constexpr double kTrackingWindow = 0.5;
+    constexpr double kTrackingSlack = 0.05;
+
+    double trackClosestPoint(double closest_point[3], double *t, const double p[3], const Path *path,
+                             const double current_t, const double t_max, const double t_previous, int *iterations)
     {
-        mjtNum *up_axis = SensorByName(model, data, "bicycle_yaxis");
-        residual[(*counter)++] = up_axis[2] - 1.0;
+        if (t_previous < current_t)
+            return path->project(closest_point, t, p, current_t, t_max, iterations);
+
+        // A few Newton steps from the previous parameter. The result is the closest point of the
+        // window when it is not stuck at an end of the short search, and nothing in the rest of
+        // the window or of its segment can be closer (the other leg of a hairpin); otherwise search
+        // the whole window. Only a second minimum within the searched piece of one segment is missed
+        const double t_start = std::max(current_t, t_previous - kTrackingSlack);
+        const double t_end = std::min(t_previous + kTrackingWindow, t_max);
+        double dist = path->refine(closest_point, t, p, t_previous, t_start, t_end, iterations);
+        const double segment = std::floor(*t);
+        const double searched_min = std::max(t_start, segment), searched_max = std::min(t_end, segment + 1);
+        if ((*t <= t_start + 1e-9 && t_start > current_t) || (*t >= t_end - 1e-9 && t_end < t_max) ||
+            !path->noneCloser(p, dist, current_t, searched_min) || !path->noneCloser(p, dist, searched_max, t_max))
+            dist = path->project(closest_point, t, p, current_t, t_max, iterations);
+        return dist;
     }
 
-    void PositionResidual(const mjModel *model, const mjData *data, double *residual, int *counter)
+    // Last projection of each thread. Planner threads reuse one mjData for consecutive rollouts, so
+    // a state continues the cached rollout when it has the same data and snapshot and a later time
+    struct TrackingCache
     {
-        mjtNum *goal_pos = SensorByName(model, data, "goal_pos");
-        mjtNum *bicycle_pos = SensorByName(model, data, "bicycle_pos");
-        mjtNum goal_displacement[3];
-        mju_sub3(goal_displacement, goal_pos, bicycle_pos);
-        mjtNum goal_distance = mju_norm3(goal_displacement);
-        residual[(*counter)++] = goal_distance;
+        const mjData *data = nullptr;
+        const Bicycle::Progress *progress = nullptr;
+        uint64_t serial = 0;
+        double time = 0;
+        double t = -1;
+    };
+
+    // Path target modes, as listed in residual_select_Path Target
+    enum PathTarget
+    {
+        kPathTargetNearest = 0, // Closest point to the current state
+        kPathTargetPreview,     // Point moving along the path at the target speed
+        kPathTargetField,       // Closest point from the path field, Nearest where the field has none
+        kPathTargetCount,
+    };
+
+    // Field lookup at p, accepted only in the projection window ahead of the progress
+    bool lookupField(double *distance, double *t, double dir[3], const double p[3],
+                     const Bicycle::Progress &progress, TaskStats &stats)
+    {
+        const PathField *field = progress.field.get();
+        bool hit = field && field->lookup(p, distance, t, dir) && *t >= progress.current_t &&
+                   *t <= progress.t_max;
+        stats.add(kStatFieldLookups);
+        stats.add(kStatFieldMisses, !hit);
+        return hit;
     }
 
-    void GoalResidual(const mjModel *model, const mjData *data, double *residual, int *counter,
-        const std::vector<double> &parameters_)
+    // Distance to the closest point and velocity error against the tangent there
+    struct PathTerm
     {
-        // The bicycle should reach the goal position at a certain speed and heading
-        mjtNum *goal_pos = SensorByName(model, data, "goal_pos");
-        mjtNum *bicycle_pos = SensorByName(model, data, "bicycle_pos");
-
-        mjtNum goal_displacement[3];
-        mju_sub3(goal_displacement, goal_pos, bicycle_pos);
-        goal_displacement[2] = 0; // Ignore the z-axis
-        mjtNum goal_distance = mju_norm3(goal_displacement);
-        residual[(*counter)++] = goal_distance;
+        static constexpr int kDim = 2;
+        static constexpr const char *kName = "Path";
+        static void Compute(const ResidualContext &ctx, double *residual)
+        {
+            // Closest point on curve, warm-started along the rollout
+            const Path *path = ctx.progress.path.get();
+            double closest_point[3], t;
+            {
+                TaskStats::Timer timer(ctx.stats, kStatPathPositionNs);
+                thread_local TrackingCache cache;
+                const mjData *data = ctx.data;
+                bool warm = cache.data == data && cache.progress == &ctx.progress &&
+                            cache.serial == ctx.progress.serial && data->time > cache.time;
+                int iterations = 0;
+                residual[0] = trackClosestPoint(closest_point, &t, data->sensordata + ctx.sensors.track_pos, path,
+                                                ctx.progress.current_t, ctx.progress.t_max, warm ? cache.t : -1,
+                                                TaskStats::kEnabled ? &iterations : nullptr);
+                cache = {data, &ctx.progress, ctx.progress.serial, data->time, t};
+                ctx.stats.add(kStatProjections);
+                ctx.stats.add(kStatProjectionWarm, warm);
+                ctx.stats.add(kStatProjectionIters, iterations);
+            }
 
-        mjtNum goal_speed = parameters_[0];
-        mjtNum *goal_xaxis = SensorByName(model, data, "goal_zaxis");
-        mjtNum goal_velocity[3];
-        mju_scl3(goal_velocity, goal_xaxis, goal_speed);
-        mjtNum *bicycle_velocity = SensorByName(model, data, "frame_subtreelinvel");
-        mjtNum velocity_error[3];
-        mju_sub3(velocity_error, goal_velocity, bicycle_velocity);
-        residual[(*counter)++] = mju_norm3(velocity_error);
-    }
+            // Velocity target on the point
+            TaskStats::Timer timer(ctx.stats, kStatPathVelocityNs);
+            mjtNum target_speed = ctx.parameters[0];
+            double vel[3];
+            path->getTangent(vel, t);
+            mju_scl3(vel, vel, target_speed);
+
+            // Calculate velocity residual
+            const mjtNum *current_vel = ctx.data->sensordata + ctx.sensors.frame_subtreelinvel;
+            mjtNum velocity_error[3];
+            mju_sub3(velocity_error, current_vel, vel);
+            residual[1] = mju_norm3(velocity_error);
+        }
+    };
 
-    int getClosestPoint(const mjModel *model, const mjData *data, const Path *path, const int current_point_i)
+    // Same entries as PathTerm from the path field, no search unless the lookup misses
+    struct FieldTerm
     {
+        static constexpr int kDim = 2;
+        static constexpr const char *kName = "Path";
+        static void Compute(const ResidualContext &ctx, double *residual)
+        {
+            double t, dir[3];
+            bool hit;
+            {
+                TaskStats::Timer timer(ctx.stats, kStatPathPositionNs);
+                hit = lookupField(&residual[0], &t, dir, ctx.data->sensordata + ctx.sensors.track_pos, ctx.progress,
+                                  ctx.stats);
+            }
+            if (!hit)
+            {
+                PathTerm::Compute(ctx, residual);
+                return;
+            }
 
-        std::vector<double> curve = path->getCurve();
+            TaskStats::Timer timer(ctx.stats, kStatPathVelocityNs);
+            mjtNum target_speed = ctx.parameters[0];
+            mju_scl3(dir, dir, target_speed);
+            const mjtNum *current_vel = ctx.data->sensordata + ctx.sensors.frame_subtreelinvel;
+            mjtNum velocity_error[3];
+            mju_sub3(velocity_error, current_vel, dir);
+            residual[1] = mju_norm3(velocity_error);
+        }
+    };
 
-        // Closest point on curve
-        // mjtNum *bicycle_pos = SensorByName(model, data, "bicycle_pos");
-        mjtNum *bicycle_pos = SensorByName(model, data, "track_pos");
-        int closest_point_i = current_point_i;
-        double closest_point[3];
-        closest_point[0] = curve[current_point_i * 3];
-        closest_point[1] = curve[current_point_i * 3 + 1];
-        closest_point[2] = curve[current_point_i * 3 + 2];
-        for (int i = closest_point_i + 1; i < curve.size() / 3; i++)
+    // Same entries as PathTerm, against the lookahead entry at the rollout time instead of a search
+    struct PreviewTerm
+    {
+        static constexpr int kDim = 2;
+        static constexpr const char *kName = "Path";
+        static void Compute(const ResidualContext &ctx, double *residual)
         {
-            double current_point[3] = {curve[i * 3], curve[i * 3 + 1], curve[i * 3 + 2]};
-            mjtNum dist = mju_dist3(bicycle_pos, current_point);
-            mjtNum cur_distance = mju_dist3(bicycle_pos, closest_point);
-            if (cur_distance >= dist)
+            const Bicycle::Lookahead &lookahead = ctx.progress.lookahead;
+            int j = (int)std::lround((ctx.data->time - lookahead.time) / lookahead.step);
+            j = std::clamp(j, 0, lookahead.size - 1);
+            const int n = lookahead.size;
             {
-                closest_point[0] = curve[i * 3];
-                closest_point[1] = curve[i * 3 + 1];
-                closest_point[2] = curve[i * 3 + 2];
-                closest_point_i = i;
-            } else {
-                break;
+                TaskStats::Timer timer(ctx.stats, kStatPathPositionNs);
+                double target[3] = {lookahead.pos[j], lookahead.pos[n + j], lookahead.pos[2 * n + j]};
+                const mjtNum *track_pos = ctx.data->sensordata + ctx.sensors.track_pos;
+                residual[0] = mju_dist3(track_pos, target);
             }
+
+            TaskStats::Timer timer(ctx.stats, kStatPathVelocityNs);
+            mjtNum target_speed = ctx.parameters[0];
+            double vel[3] = {lookahead.dir[j], lookahead.dir[n + j], lookahead.dir[2 * n + j]};
+            mju_scl3(vel, vel, target_speed);
+
+            const mjtNum *current_vel = ctx.data->sensordata + ctx.sensors.frame_subtreelinvel;
+            mjtNum velocity_error[3];
+            mju_sub3(velocity_error, current_vel, vel);
+            residual[1] = mju_norm3(velocity_error);
         }
+    };
+
+    // Terminal residual ---------------------------------------------------------------------------------------------
+    // Opt-in cost shaping, only with a bicycle_terminal_distance above 0: a rollout state is terminal once
+    // the bicycle fell or the tracked site left the path by more than that distance, and stays terminal
+    // for the rest of the rollout. The planner still steps it to the horizon, but a terminal state skips
+    // the path search and scores a fixed, bounded residual: no action, the terminal distance, and the
+    // target speed as the velocity error (a bicycle at rest)
+
+    // z of the frame's y axis below which the bicycle has fallen, for rollouts and episodes alike
+    constexpr double kFallUpAxis = 0.4;
+
+    bool isFallen(double up_z) { return up_z != 0 && up_z < kFallUpAxis; }
 
-        return closest_point_i;
+    void terminalResidual(double *residual, double terminal_distance, double speed)
+    {
+        mju_zero(residual, Bicycle::kHumanoidControls);
+        residual[Bicycle::kHumanoidControls] = terminal_distance;
+        residual[Bicycle::kHumanoidControls + 1] = speed;
     }
 
-    void PathResidual(const mjModel *model, const mjData *data, double *residual, int *counter,
-        const std::vector<double> &parameters_, const Path *path, int current_point_i)
+    // Whether the last state of each thread was terminal, continued like TrackingCache
+    struct TerminalCache
+    {
+        const mjData *data = nullptr;
+        const Bicycle::Progress *progress = nullptr;
+        uint64_t serial = 0;
+        double time = 0;
+        bool terminal = false;
+    };
+
+    // Residual variants ---------------------------------------------------------------------------------------------
+    // The user sensors of task.xml list the same terms in the same order; bicycle_residual picks the variant
+    using PathTrackingResidual = ResidualTerms<ResidualContext, ActionTerm, PathTerm>;
+    using PathPreviewResidual = ResidualTerms<ResidualContext, ActionTerm, PreviewTerm>;
+    using PathFieldResidual = ResidualTerms<ResidualContext, ActionTerm, FieldTerm>;
+    using GoalReachingResidual = ResidualTerms<ResidualContext, ActionTerm, GoalTerm>;
+    using BalanceResidual = ResidualTerms<ResidualContext, ActionTerm, BalanceTerm>;
+    static_assert(PathTrackingResidual::kDim == PathPreviewResidual::kDim);
+    static_assert(PathTrackingResidual::kDim == PathFieldResidual::kDim);
+
+    using ResidualKernel = void (*)(const ResidualContext &, double *);
+
+    struct ResidualVariant
     {
-        std::vector<double> curve = path->getCurve();
+        const char *name;
+        ResidualKernel kernel[kPathTargetCount];
+        bool (*check)(const mjModel *, char *, int);
+        bool needs_goal;
+    };
+
+    // Index of the variant with a batched form, see Bicycle::ResidualBatch
+    constexpr int kPathTrackingVariant = 0;
+
+    constexpr ResidualVariant kResidualVariants[] = {
+        {"Path Tracking", {PathTrackingResidual::Compute, PathPreviewResidual::Compute, PathFieldResidual::Compute},
+         PathTrackingResidual::Check, false},
+        {"Goal Reaching", {GoalReachingResidual::Compute, GoalReachingResidual::Compute, GoalReachingResidual::Compute},
+         GoalReachingResidual::Check, true},
+        {"Balance", {BalanceResidual::Compute, BalanceResidual::Compute, BalanceResidual::Compute},
+         BalanceResidual::Check, false},
+    };
 
-        // Closest point on curve
-        // mjtNum *bicycle_pos = SensorByName(model, data, "bicycle_pos");
-        mjtNum *bicycle_pos = SensorByName(model, data, "track_pos");
-        int closest_point_i = getClosestPoint(model, data, path, current_point_i);
-        double closest_point[3] = {curve[closest_point_i * 3], curve[closest_point_i * 3 + 1], curve[closest_point_i * 3 + 2]};
+    void Bicycle::ResidualFn::Residual(const mjModel *model, const mjData *data,
+                                       double *residual) const
+    {
+        const Bicycle *task = dynamic_cast<const Bicycle *>(task_);
+        const ParameterTable &table = task->getParameterTable();
+        TaskStats &stats = task->stats_;
+        stats.add(kStatResidualCalls);
+
+        const ResidualContext ctx = {model, data, task->getSensors(), parameters_, progress_, task, stats};
+        int target = ReinterpretAsInt(parameters_[table.path_target]);
+        if (target < 0 || target >= kPathTargetCount)
+            target = kPathTargetNearest;
+        if (table.residual_variant != kPathTrackingVariant || table.terminal_distance <= 0)
+        {
+            kResidualVariants[table.residual_variant].kernel[target](ctx, residual);
+            return;
+        }
 
-        mjtNum dist = mju_dist3(bicycle_pos, closest_point);
-        residual[(*counter)++] = dist;
+        thread_local TerminalCache cache;
+        const bool latched = cache.terminal && cache.data == data && cache.progress == &progress_ &&
+                             cache.serial == progress_.serial && data->time > cache.time;
+        bool terminal = latched || isFallen(data->sensordata[ctx.sensors.bicycle_yaxis + 2]);
+        if (!terminal)
+        {
+            kResidualVariants[table.residual_variant].kernel[target](ctx, residual);
+            terminal = residual[kHumanoidControls] > table.terminal_distance;
+        }
+        if (terminal)
+        {
+            terminalResidual(residual, table.terminal_distance, parameters_[0]);
+            stats.add(kStatTerminalStates);
+            stats.add(kStatTerminalRollouts, !latched);
+        }
+        cache = {data, &progress_, progress_.serial, data->time, terminal};
+    }
 
-        // Velocity target on the point
-        mjtNum target_speed = parameters_[0];
-        double p0[3], p1[3];
-        double t = (double)closest_point_i / (curve.size() / 3) * (path->getNumAnchors() - 1);
-        double k = 0.01;
-        if (closest_point_i == 0)
+    void Bicycle::GatherState(StateBatch *batch, int i, const mjModel *model, const mjData *data) const
+    {
+        const int n = batch->count;
+        batch->time[i] = data->time;
+        batch->up[i] = data->sensordata[sensors_.bicycle_yaxis + 2];
+        const double *track_pos = data->sensordata + sensors_.track_pos;
+        const double *linvel = data->sensordata + sensors_.frame_subtreelinvel;
+        for (int k = 0; k < 3; k++)
         {
-            p0[0] = closest_point[0];
-            p0[1] = closest_point[1];
-            p0[2] = closest_point[2];
+            batch->track_pos[k * n + i] = track_pos[k];
+            batch->linvel[k * n + i] = linvel[k];
         }
-        else
+        const int pad = kHumanoidControls - std::min(model->nu, kHumanoidControls);
+        const double *action = data->ctrl + model->nu - (kHumanoidControls - pad);
+        for (int a = 0; a < kHumanoidControls; a++)
+            batch->action[a * n + i] = a < pad ? 0 : action[a - pad];
+    }
+
+    // out[i] = |a_i - scale b_i| for columns of x, y and z arrays, in SIMD lanes where the target has them
+    void DifferenceNorms(double *out, const double *const a[3], const double *const b[3], double scale, int n)
+    {
+        int i = 0;
+#if defined(__AVX2__)
+        const __m256d s = _mm256_set1_pd(scale);
+        for (; i + 4 <= n; i += 4)
         {
-            path->getPoint(p0, t - k);
+            __m256d sum = _mm256_setzero_pd();
+            for (int k = 0; k < 3; k++)
+            {
+                __m256d e = _mm256_sub_pd(_mm256_loadu_pd(a[k] + i), _mm256_mul_pd(s, _mm256_loadu_pd(b[k] + i)));
+                sum = _mm256_add_pd(sum, _mm256_mul_pd(e, e));
+            }
+            _mm256_storeu_pd(out + i, _mm256_sqrt_pd(sum));
         }
-        if (closest_point_i == curve.size() / 3 - 1)
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        const float64x2_t s = vdupq_n_f64(scale);
+        for (; i + 2 <= n; i += 2)
         {
-            p1[0] = closest_point[0];
-            p1[1] = closest_point[1];
-            p1[2] = closest_point[2];
+            float64x2_t sum = vdupq_n_f64(0);
+            for (int k = 0; k < 3; k++)
+            {
+                float64x2_t e = vfmsq_f64(vld1q_f64(a[k] + i), s, vld1q_f64(b[k] + i));
+                sum = vfmaq_f64(sum, e, e);
+            }
+            vst1q_f64(out + i, vsqrtq_f64(sum));
         }
-        else
+#endif
+        for (; i < n; i++)
         {
-            path->getPoint(p1, t + k);
+            double ex = a[0][i] - scale * b[0][i], ey = a[1][i] - scale * b[1][i], ez = a[2][i] - scale * b[2][i];
+            out[i] = std::sqrt(ex * ex + ey * ey + ez * ez);
         }
-        // Unit vector between points
-        double vel[3];
-        mju_sub3(vel, p1, p0);
-        mju_normalize3(vel);
-        mju_scl3(vel, vel, target_speed);
-
-        // Calculate velocity residual
-        mjtNum *current_vel = SensorByName(model, data, "frame_subtreelinvel");
-        mjtNum velocity_error[3];
-        mju_sub3(velocity_error, current_vel, vel);
-        residual[(*counter)++] = mju_norm3(velocity_error);
     }
 
-    void Bicycle::ResidualFn::Residual(const mjModel *model, const mjData *data,
-                                       double *residual) const
+    // Path Tracking over a whole batch: the distances and directions first, then the velocity
+    // errors. Lookahead distances, tangents and velocity errors run over the columns in SIMD lanes;
+    // the projection is a Newton search per state, warm-started from the column before
+    bool Bicycle::ResidualBatch(const StateBatch &batch, double *residual) const
     {
-        int counter = 0;
+        if (parameter_table_.residual_variant != kPathTrackingVariant)
+            return false;
+        constexpr int dim = PathTrackingResidual::kDim;
+        const int n = batch.count;
+        stats_.add(kStatResidualCalls, n);
+
+        // Action rows
+        for (int a = 0; a < kHumanoidControls; a++)
+        {
+            const double *column = &batch.action[a * n];
+            for (int i = 0; i < n; i++)
+                residual[i * dim + a] = column[i];
+        }
 
-        // PositionResidual(model, data, residual, &counter);
-        // VelocityResidual(model, data, residual, &counter, parameters_);
-        // BalanceResidual(model, data, residual, &counter);
-        ActionResidual(model, data, residual, &counter);
-        // PoseResidual(model, data, residual, &counter);
-        // GoalResidual(model, data, residual, &counter, parameters_);
-        const Bicycle *task = dynamic_cast<const Bicycle *>(task_);
-        PathResidual(model, data, residual, &counter, parameters_, task->getPath(), task->current_point_i);
+        // Distance to the target and unit direction of every state. Terminal states, as in Residual, are
+        // left out of the search; the columns in increasing time continue the same rollout. The work
+        // columns belong to the batch, sized by its resize
+        StateBatch::Scratch &scratch = batch.scratch;
+        std::vector<double> &distance = scratch.distance, &dir = scratch.dir, &t = scratch.t;
+        std::vector<double> &point = scratch.point, &error = scratch.error;
+        std::vector<char> &terminal = scratch.terminal, &latched = scratch.latched;
+        std::fill_n(terminal.begin(), n, 0);
+        std::fill_n(latched.begin(), n, 0);
+        const double terminal_distance = parameter_table_.terminal_distance;
+        auto ended = [&](int i) {
+            latched[i] = i > 0 && batch.time[i] > batch.time[i - 1] && terminal[i - 1];
+            terminal[i] = latched[i] || (terminal_distance > 0 && isFallen(batch.up[i]));
+            return terminal[i];
+        };
+        const std::vector<double> &parameters = residual_.parameters_;
+        const Progress &progress = residual_.progress_;
+        const double *px = &batch.track_pos[0], *py = &batch.track_pos[n], *pz = &batch.track_pos[2 * n];
+        const double *const track[3] = {px, py, pz};
+        const int target = ReinterpretAsInt(parameters[parameter_table_.path_target]);
+        if (target == kPathTargetPreview)
+        {
+            // Lookahead entries at the rollout times into columns and every distance at once, the
+            // end of a rollout depends on the state before so it is found after
+            const Lookahead &lookahead = progress.lookahead;
+            const int size = lookahead.size;
+            for (int i = 0; i < n; i++)
+            {
+                int j = (int)std::lround((batch.time[i] - lookahead.time) / lookahead.step);
+                j = std::clamp(j, 0, size - 1);
+                for (int k = 0; k < 3; k++)
+                {
+                    point[k * n + i] = lookahead.pos[k * size + j];
+                    dir[k * n + i] = lookahead.dir[k * size + j];
+                }
+            }
+            const double *const columns[3] = {&point[0], &point[n], &point[2 * n]};
+            DifferenceNorms(distance.data(), columns, track, 1, n);
+            for (int i = 0; i < n; i++)
+                if (!ended(i))
+                    terminal[i] = terminal_distance > 0 && distance[i] > terminal_distance;
+        }
+        else
+        {
+            TaskStats::Timer timer(stats_, kStatPathPositionNs);
+            const bool field = target == kPathTargetField;
+            int iterations = 0, warm = 0, projections = 0;
+            for (int i = 0; i < n; i++)
+            {
+                if (ended(i))
+                {
+                    t[i] = progress.current_t; // Any parameter, for the tangents below
+                    continue;
+                }
+                const double p[3] = {px[i], py[i], pz[i]};
+                double d[3];
+                if (field && lookupField(&distance[i], &t[i], d, p, progress, stats_))
+                {
+                    terminal[i] = terminal_distance > 0 && distance[i] > terminal_distance;
+                    for (int k = 0; k < 3; k++)
+                        dir[k * n + i] = d[k];
+                    continue;
+                }
+                double t_previous = i > 0 && batch.time[i] > batch.time[i - 1] ? t[i - 1] : -1;
+                warm += t_previous >= 0;
+                projections++;
+                double q[3];
+                distance[i] = trackClosestPoint(q, &t[i], p, progress.path.get(), progress.current_t, progress.t_max,
+                                                t_previous, TaskStats::kEnabled ? &iterations : nullptr);
+                terminal[i] = terminal_distance > 0 && distance[i] > terminal_distance;
+                if (field)
+                {
+                    progress.path->getTangent(d, t[i]);
+                    for (int k = 0; k < 3; k++)
+                        dir[k * n + i] = d[k];
+                }
+            }
+            stats_.add(kStatProjections, projections);
+            stats_.add(kStatProjectionWarm, warm);
+            stats_.add(kStatProjectionIters, iterations);
+            if (!field)
+                progress.path->getTangents(dir.data(), dir.data() + n, dir.data() + 2 * n, t.data(), n);
+        }
 
-        int user_sensor_dim = 0;
-        for (int i = 0; i < model->nsensor; i++)
-            if (model->sensor_type[i] == mjSENS_USER)
-                user_sensor_dim += model->sensor_dim[i];
-        if (user_sensor_dim != counter)
-            mju_error_i(
-                "mismatch between total user-sensor dimension "
-                "and actual length of residual %d",
-                counter);
+        // Velocity error against speed * dir
+        TaskStats::Timer timer(stats_, kStatPathVelocityNs);
+        const double speed = parameters[0];
+        const double *const velocity[3] = {&batch.linvel[0], &batch.linvel[n], &batch.linvel[2 * n]};
+        const double *const direction[3] = {&dir[0], &dir[n], &dir[2 * n]};
+        DifferenceNorms(error.data(), velocity, direction, speed, n);
+        int terminal_states = 0, terminal_rollouts = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (terminal[i])
+            {
+                terminalResidual(&residual[i * dim], terminal_distance, speed);
+                terminal_states++;
+                terminal_rollouts += !latched[i];
+                continue;
+            }
+            residual[i * dim + kHumanoidControls] = distance[i];
+            residual[i * dim + kHumanoidControls + 1] = error[i];
+        }
+        stats_.add(kStatTerminalStates, terminal_states);
+        stats_.add(kStatTerminalRollouts, terminal_rollouts);
+        return true;
     }
 
-    void Bicycle::ModifyScene(const mjModel *model, const mjData *data, mjvScene *scene) const
+    // Scene overlay ----------------------------------------------------------------------------------------------------
+    // Geoms per layer, so a long route can never crowd out the markers or fill the scene
+    constexpr int kCurveGeomBudget = 400;
+    constexpr int kAnchorGeomBudget = 128;
+    constexpr int kMarkerGeoms = 3;
+    // Curve strides double every kLodDistance meters ahead of the rider
+    constexpr double kLodDistance = 20;
+    // Control handles are only drawn for anchors this close along the path
+    constexpr double kHandleDistance = 30;
+    // The cached layers are rebuilt when the progress moved this many curve samples
+    constexpr int kOverlayRebuildSamples = 10;
+
+    // Builds the curve and anchor layers from the current progress on. Only ModifyScene calls it,
+    // from the render thread
+    void Bicycle::BuildOverlay() const
     {
-        // Draw path segments ------------------------------------------------------------------------------------------
-        float segment_color[4] = {1.0, 0.0, 1.0, 1.0};
-        double zero3[3] = {0};
-        double zero9[9] = {0};
-        float width = 0.01;
-        std::vector<double> curve = path_->getCurve();
-        int n_points = curve.size() / 3;
-
-        for (size_t i = current_point_i; i < n_points - 1; i++)
+        const Path &path = *path_;
+        overlay_.path = path_;
+        overlay_.point_i = current_point_i;
+        overlay_.curve.clear();
+        overlay_.anchors.clear();
+        const double zero3[3] = {0};
+        const double zero9[9] = {0};
+        const double width = 0.01;
+
+        // Curve, one capsule per sample next to the rider and longer chords further on
+        const float segment_color[4] = {1.0, 0.0, 1.0, 1.0};
+        std::span<const double> curve = path.getCurve();
+        const int n_points = curve.size() / 3;
+        int i = std::clamp(current_point_i - path.getFirstPoint(), 0, std::max(n_points - 1, 0));
+        double distance = 0;
+        while (i < n_points - 1 && (int)overlay_.curve.size() < kCurveGeomBudget)
         {
-            // check max geoms
-            if (scene->ngeom >= scene->maxgeom)
+            int stride = 1 << std::min((int)(distance / kLodDistance), 16);
+            int j = std::min(i + stride, n_points - 1);
+            const double *a = &curve[i * 3], *b = &curve[j * 3];
+            double length = mju_dist3(a, b);
+            if (length > 0) // Segments share their end samples
             {
-                printf("max geom!!!\n");
-                continue;
+                mjvGeom geom;
+                mjv_initGeom(&geom, mjGEOM_CAPSULE, zero3, zero3, zero9, segment_color);
+                mjv_makeConnector(&geom, mjGEOM_CAPSULE, width, a[0], a[1], a[2], b[0], b[1], b[2]);
+                overlay_.curve.push_back(geom);
             }
+            distance += length;
+            i = j;
+        }
 
-            // initialize geometry
-            mjv_initGeom(&scene->geoms[scene->ngeom], mjGEOM_CAPSULE, zero3, zero3, zero9,
-                         segment_color);
-
-            // make geometry
-            double a[3], b[3];
-            a[0] = curve[i * 3 + 0];
-            a[1] = curve[i * 3 + 1];
-            a[2] = curve[i * 3 + 2];
-            b[0] = curve[(i + 1) * 3 + 0];
-            b[1] = curve[(i + 1) * 3 + 1];
-            b[2] = curve[(i + 1) * 3 + 2];
-
-            mjv_makeConnector(
-                &scene->geoms[scene->ngeom], mjGEOM_CAPSULE, width,
-                a[0], a[1], a[2], b[0], b[1], b[2]);
-            // increment number of geometries
-            scene->ngeom += 1;
-        }
-
-        // Draw the anchors --------------------------------------------------------------------------------------------
-        float anchor_color[4] = {0.0, 1.0, 0.0, 1.0};
-        int num_anchors = path_->getNumAnchors();
-        for (int i = 0; i < num_anchors; i++)
-        {
-            double pos[3];
-            path_->getAnchor(pos, i);
-            double size[3] = {width*2, width*2, width*2};
-            AddGeom(scene, mjGEOM_SPHERE, size, pos, nullptr, anchor_color);
-
-            double ctl_left[3], ctl_right[3];
-            double ctl_size[3] = {width, width, width};
-            float ctl_color[4] = {0.0, 1.0, 1.0, 1.0};
-            path_->getLeftControl(ctl_left, i);
-            path_->getRightControl(ctl_right, i);
-            AddGeom(scene, mjGEOM_SPHERE, ctl_size, ctl_left, nullptr, ctl_color);
-            AddGeom(scene, mjGEOM_SPHERE, ctl_size, ctl_right, nullptr, ctl_color);
-            mjv_initGeom(&scene->geoms[scene->ngeom], mjGEOM_CAPSULE, zero3, zero3, zero9, ctl_color);
-            mjv_makeConnector(
-                &scene->geoms[scene->ngeom], mjGEOM_CAPSULE, width/2,
-                ctl_left[0], ctl_left[1], ctl_left[2], ctl_right[0], ctl_right[1], ctl_right[2]);
-            scene->ngeom += 1;
-        }
-
-        // Draw closest_point ------------------------------------------------------------------------------------------
-        int closest_point_i = getClosestPoint(model, data, path_, current_point_i);
-        double closest_point[3] = {curve[closest_point_i * 3], curve[closest_point_i * 3 + 1], curve[closest_point_i * 3 + 2]};
+        // Anchors ahead of the rider, with their handles while they are close
+        const float anchor_color[4] = {0.0, 1.0, 0.0, 1.0};
+        const float ctl_color[4] = {0.0, 1.0, 1.0, 1.0};
+        const double size[3] = {width * 2, width * 2, width * 2};
+        const double ctl_size[3] = {width, width, width};
+        for (int a = std::max(path.getFirstAnchor(), (int)current_t); a < path.getNumAnchors(); a++)
+        {
+            bool handles = path.getArcLength(a) - current_s < kHandleDistance;
+            if ((int)overlay_.anchors.size() + (handles ? 4 : 1) > kAnchorGeomBudget)
+                break;
+            double pos[3], ctl_left[3], ctl_right[3];
+            path.getAnchor(pos, a);
+            overlay_.anchors.emplace_back();
+            mjv_initGeom(&overlay_.anchors.back(), mjGEOM_SPHERE, size, pos, nullptr, anchor_color);
+            if (!handles)
+                continue;
+            path.getLeftControl(ctl_left, a);
+            path.getRightControl(ctl_right, a);
+            mjvGeom geom;
+            mjv_initGeom(&geom, mjGEOM_SPHERE, ctl_size, ctl_left, nullptr, ctl_color);
+            overlay_.anchors.push_back(geom);
+            mjv_initGeom(&geom, mjGEOM_SPHERE, ctl_size, ctl_right, nullptr, ctl_color);
+            overlay_.anchors.push_back(geom);
+            mjv_initGeom(&geom, mjGEOM_CAPSULE, zero3, zero3, zero9, ctl_color);
+            mjv_makeConnector(&geom, mjGEOM_CAPSULE, width / 2, ctl_left[0], ctl_left[1], ctl_left[2],
+                              ctl_right[0], ctl_right[1], ctl_right[2]);
+            overlay_.anchors.push_back(geom);
+        }
+    }
+
+    void Bicycle::ModifyScene(const mjModel *, const mjData *data, mjvScene *scene) const
+    {
+        if (overlay_.path != path_ || std::abs(current_point_i - overlay_.point_i) >= kOverlayRebuildSamples)
+            BuildOverlay();
+
+        // Closest point and the current and target velocities ----------------------------------------------------------
+        double zero3[3] = {0};
+        double zero9[9] = {0};
+        mjvGeom markers[kMarkerGeoms];
+        double closest_point[3], t;
+        getClosestPoint(closest_point, &t, data, sensors_, path_.get(), current_t, getProjectionEnd(current_t));
         const float c_color[4] = {0.0, 1.0, 0.0, 0.3};
         const double c_size[3] = {0.1, 0.1, 0.1};
-        AddGeom(scene, mjGEOM_SPHERE, c_size, closest_point, nullptr, c_color);
+        mjv_initGeom(&markers[0], mjGEOM_SPHERE, c_size, closest_point, nullptr, c_color);
 
-        // Draw current and target velocity ----------------------------------------------------------------------------
-        mjtNum *currentVel = SensorByName(model, data, "frame_subtreelinvel");
-        mjtNum *bicycle_pos = SensorByName(model, data, "track_pos");
-        mjv_initGeom(&scene->geoms[scene->ngeom], mjGEOM_ARROW, zero3, zero3, zero9, c_color);
-        mjv_makeConnector(&scene->geoms[scene->ngeom], mjGEOM_ARROW, 0.05,
+        mjtNum *currentVel = data->sensordata + sensors_.frame_subtreelinvel;
+        mjtNum *bicycle_pos = data->sensordata + sensors_.track_pos;
+        mjv_initGeom(&markers[1], mjGEOM_ARROW, zero3, zero3, zero9, c_color);
+        mjv_makeConnector(&markers[1], mjGEOM_ARROW, 0.05,
                           bicycle_pos[0], bicycle_pos[1], bicycle_pos[2],
                           bicycle_pos[0] + currentVel[0], bicycle_pos[1] + currentVel[1], bicycle_pos[2] + currentVel[2]);
-        scene->ngeom += 1;
 
-        // Velocity target on the point --------------------------------------------------------------------------------
         mjtNum target_speed = residual_.parameters_[0];
-        double p0[3], p1[3];
-        double t = (double)closest_point_i / (curve.size() / 3) * (path_->getNumAnchors() - 1);
-        double k = 0.01;
-        if (closest_point_i == 0)
-        {
-            p0[0] = closest_point[0];
-            p0[1] = closest_point[1];
-            p0[2] = closest_point[2];
-        }
-        else
-        {
-            path_->getPoint(p0, t - k);
-        }
-        if (closest_point_i == curve.size() / 3 - 1)
-        {
-            p1[0] = closest_point[0];
-            p1[1] = closest_point[1];
-            p1[2] = closest_point[2];
-        }
-        else
-        {
-            path_->getPoint(p1, t + k);
-        }
-
-        // Unit vector between points ----------------------------------------------------------------------------------
         double vel[3];
-        mju_sub3(vel, p1, p0);
-        mju_normalize3(vel);
+        path_->getTangent(vel, t);
         mju_scl3(vel, vel, target_speed);
-
-        mjv_initGeom(&scene->geoms[scene->ngeom], mjGEOM_ARROW, zero3, zero3, zero9, c_color);
-        mjv_makeConnector(&scene->geoms[scene->ngeom], mjGEOM_ARROW, 0.05,
+        mjv_initGeom(&markers[2], mjGEOM_ARROW, zero3, zero3, zero9, c_color);
+        mjv_makeConnector(&markers[2], mjGEOM_ARROW, 0.05,
                           closest_point[0], closest_point[1], closest_point[2],
                           closest_point[0] + vel[0], closest_point[1] + vel[1], closest_point[2] + vel[2]);
-        scene->ngeom += 1;
+
+        // Markers first, then as much of the cached layers as the scene has room for
+        auto append = [&](const mjvGeom *geoms, int count) {
+            int n = std::clamp(scene->maxgeom - scene->ngeom, 0, count);
+            std::copy(geoms, geoms + n, scene->geoms + scene->ngeom);
+            scene->ngeom += n;
+            if (n < count)
+                stats_.add(kStatMaxGeomHits, count - n);
+        };
+        append(markers, kMarkerGeoms);
+        append(overlay_.anchors.data(), overlay_.anchors.size());
+        append(overlay_.curve.data(), overlay_.curve.size());
     }
 
     void Bicycle::TransitionLocked(mjModel *model, mjData *data)
     {
+        TaskStats::Timer transition_timer(stats_, kStatTransitionNs);
+        stats_.add(kStatTransitions);
+
         // Transmission ------------------------------------------------------------------------------------------------
-        mjtNum *current_pos = SensorByName(model, data, "bicycle_pos");
+        mjtNum *current_pos = data->sensordata + sensors_.bicycle_pos;
         double tolerance = 0.5;
         mjtNum current_goal_pos[3];
         mju_copy3(current_goal_pos, data->mocap_pos);
@@ -413,94 +808,462 @@ namespace mjpc
         }
 
         // Update path -------------------------------------------------------------------------------------------------
-        const auto now = steady_clock::now();
-        const std::vector<double> curve = path_->getCurve();
-        const int closest_point_i = getClosestPoint(model, data, path_, current_point_i);
+        const double now = data->time;
+        double target_pos[3], closest_t;
+        int iterations = 0;
+        getClosestPoint(target_pos, &closest_t, data, sensors_, path_.get(), current_t, getProjectionEnd(current_t),
+                        TaskStats::kEnabled ? &iterations : nullptr);
+        stats_.add(kStatProjections);
+        stats_.add(kStatProjectionIters, iterations);
+        const int closest_point_i = path_->getSampleIndex(closest_t);
         if (closest_point_i != current_point_i)
         {
             last_advance = now;
-            if (start_time == time_point<steady_clock>::min())
+            if (start_time < 0)
                 start_time = now;
         }
+        current_t = closest_t;
         current_point_i = closest_point_i;
+        if (route_stream_)
+            UpdateRouteWindow();
+        current_s = path_->getArcLength(current_t);
+        UpdateLookahead(data->time);
+        PublishProgress();
 
         // Metrics -----------------------------------------------------------------------------------------------------
-        double cur_pos[3], target_pos[3];
-        memcpy(&cur_pos, SensorByName(model, data, "track_pos"), 3 * sizeof(double));
-        memcpy(&target_pos, &curve[current_point_i * 3], 3 * sizeof(double));
-
-        double current_distance = sqrt(pow(target_pos[0] - cur_pos[0], 2) + pow(target_pos[1] - cur_pos[1], 2));
-        bool trajectoryUpdated = metrics->updateTrajectoryError(curve, current_point_i, current_distance);
-
-        // SensorData --------------------------------------------------------------------------------------------------
-        if (trajectoryUpdated) {
-            double *site_sensor = SensorByName(model, data, "track_pos");
-            if (!site_sensor)
-                mju_error("track_pos: sensor not found");
-            Point site = {site_sensor[0], site_sensor[1], site_sensor[2]};
-
-            double *com_sensor = SensorByName(model, data, "frame_subtreecom");
-            if (!com_sensor)
-                mju_error("frame_subtreecom: sensor not found");
-            Point com = {com_sensor[0], com_sensor[1], com_sensor[2]};
-
-            double *xaxis_sensor = SensorByName(model, data, "bicycle_xaxis");
-            double *yaxis_sensor = SensorByName(model, data, "bicycle_yaxis");
-            double *zaxis_sensor = SensorByName(model, data, "bicycle_zaxis");
-            if (!xaxis_sensor || !yaxis_sensor || !zaxis_sensor)
-                mju_error("bicycle_axis: sensor not found");
-            Point euler = {*xaxis_sensor, *yaxis_sensor, *zaxis_sensor};
-
-            double *linvel_sensor = SensorByName(model, data, "frame_subtreelinvel");
-            if (!linvel_sensor)
-                mju_error("frame_subtreeinvel: sensor not found");
-            Point linear = {linvel_sensor[0], linvel_sensor[1], linvel_sensor[2]};
-
-            double *angvel_sensor = SensorByName(model, data, "frame_frameangvel");
-            if (!angvel_sensor)
-                mju_error("frame_frameangvel: sensor not found");
-            Point angular = {angvel_sensor[0], angvel_sensor[1], angvel_sensor[2]};
-
-            double control_efford = 0;
-            for (int i = 0; i < model->nu; i++) {
-                control_efford += abs(data->ctrl[i]);
+        // Only copy the raw values here, the telemetry thread does the bookkeeping and the writing
+        TelemetryRecord record;
+        record.kind = TelemetryRecord::kSample;
+        record.time = now;
+        record.start_time = start_time;
+        record.point_i = current_point_i;
+        record.first_point_i = path_->getFirstPoint();
+        const double *site_sensor = data->sensordata + sensors_.track_pos;
+        record.distance = sqrt(pow(target_pos[0] - site_sensor[0], 2) + pow(target_pos[1] - site_sensor[1], 2));
+        mju_copy3(record.target, target_pos);
+        mju_copy3(record.site, site_sensor);
+        mju_copy3(record.com, data->sensordata + sensors_.frame_subtreecom);
+        record.euler[0] = data->sensordata[sensors_.bicycle_xaxis];
+        record.euler[1] = data->sensordata[sensors_.bicycle_yaxis];
+        record.euler[2] = data->sensordata[sensors_.bicycle_zaxis];
+        mju_copy3(record.linvel, data->sensordata + sensors_.frame_subtreelinvel);
+        mju_copy3(record.angvel, data->sensordata + sensors_.frame_frameangvel);
+        record.nu = model->nu;
+        if (model->nu <= kTelemetryControls)
+            mju_copy(record.ctrl, data->ctrl, model->nu);
+        else
+            record.control_effort = mju_L1(data->ctrl, model->nu) / model->nu;
+        PushTelemetry(record, false);
+
+        if (TaskStats::kEnabled && stats_period > 0 && (now - last_stats >= stats_period || now < last_stats))
+        {
+            last_stats = now;
+            TelemetryRecord print;
+            print.kind = TelemetryRecord::kStats;
+            PushTelemetry(print, false);
+        }
+
+        // Task End Condition ------------------------------------------------------------------------------------------
+        if (episode_end != kEpisodeRunning)
+            return;
+        bool timeout = last_advance >= 0 && now - last_advance > advance_timeout;
+        bool goal_reached = current_point_i >= path_->getNumPoints() - 1 && (!route_stream_ || route_stream_->finished());
+
+        // Task if roll angle too big
+        bool fail = isFallen(data->sensordata[sensors_.bicycle_yaxis + 2]);
+
+        if (timeout || goal_reached || fail) {
+            episode_end = goal_reached ? kEpisodeGoal : fail ? kEpisodeFall : kEpisodeTimeout;
+            record.kind = TelemetryRecord::kEpisodeEnd;
+            record.max_i = path_->getNumPoints() - 1;
+            PushTelemetry(record, true);
+        }
+    }
+
+    // Telemetry ---------------------------------------------------------------------------------------------------------
+
+    // Transition and Reset both run under the simulation mutex, so they act as the single producer.
+    // Samples are dropped when the writer falls behind, episode boundaries wait for room instead.
+    void Bicycle::PushTelemetry(const TelemetryRecord &record, bool required)
+    {
+        if (required)
+            while (telemetry_.full())
+                std::this_thread::yield();
+        telemetry_.push(record);
+    }
+
+    void Bicycle::TelemetryLoop()
+    {
+        TelemetryRecord record;
+        while (true)
+        {
+            if (telemetry_.pop(record))
+            {
+                ProcessTelemetry(record);
+                telemetry_processed_.fetch_add(1, std::memory_order_release);
+                continue;
             }
-            control_efford /= model->nu;
+            if (telemetry_stop_.load(std::memory_order_acquire))
+            {
+                while (telemetry_.pop(record))
+                {
+                    ProcessTelemetry(record);
+                    telemetry_processed_.fetch_add(1, std::memory_order_release);
+                }
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
 
-            Point target_point = {target_pos[0], target_pos[1], target_pos[2]};
+    void Bicycle::ProcessTelemetry(const TelemetryRecord &record)
+    {
+        switch (record.kind)
+        {
+        case TelemetryRecord::kReset:
+            metrics->reset(record.max_i);
+            break;
+        case TelemetryRecord::kSample:
+        {
+            metrics->settleBefore(record.first_point_i);
+            bool trajectoryUpdated = metrics->updateTrajectoryError(record.point_i, record.distance);
+            if (!trajectoryUpdated && !record_every_step)
+                break;
 
-            auto duration = steady_clock::now() - start_time;
-            double time = duration.count();
+            double control_efford = record.control_effort;
+            if (record.nu <= kTelemetryControls) {
+                control_efford = 0;
+                for (int i = 0; i < record.nu; i++)
+                    control_efford += std::abs(record.ctrl[i]);
+                control_efford /= record.nu;
+            }
 
-            metrics->updateTimeSeriesData(site, com, euler, linear, angular, target_point, control_efford, time);
+            auto point = [](const double v[3]) { return Point{v[0], v[1], v[2]}; };
+            metrics->updateTimeSeriesData(point(record.site), point(record.com), point(record.euler),
+                                          point(record.linvel), point(record.angvel), point(record.target),
+                                          control_efford, record.start_time >= 0 ? record.time - record.start_time : 0);
+            break;
+        }
+        case TelemetryRecord::kEpisodeEnd:
+            // A rider that never advanced along the path has no start time and took none on it
+            metrics->updateTrajectoryTime(record.start_time >= 0 ? record.start_time : record.time, record.time);
+            metrics->updateSuccessRate(record.point_i, record.max_i);
+            if (print_metrics)
+                metrics->print();
+            metrics->flushTimeSeries();
+            break;
+        case TelemetryRecord::kStats:
+            stats_.snapshot().print(stderr);
+            break;
         }
+    }
 
+    Bicycle::TelemetryStats Bicycle::getTelemetryStats() const
+    {
+        return {telemetry_.pushed(), telemetry_.dropped(), telemetry_processed_.load(std::memory_order_acquire)};
+    }
 
-        // Task End Condition ------------------------------------------------------------------------------------------
-        return;
-        duration<double> time_since_advance = now - last_advance;
-        bool timeout = time_since_advance > advance_timeout && last_advance > time_point<steady_clock>::min();
-        bool goal_reached = current_point_i >= curve.size()/3 - 1;
+    void Bicycle::FlushTelemetry() const
+    {
+        const uint64_t pushed = telemetry_.pushed();
+        while (telemetry_processed_.load(std::memory_order_acquire) < pushed)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
 
-        // Task if roll angle too big
-        mjtNum *up_axis = SensorByName(model, data, "bicycle_yaxis");
-        bool fail = up_axis[2] != 0 && up_axis[2] < 0.4;
+    // Snapshots --------------------------------------------------------------------------------------------------------
+
+    void Bicycle::SaveSnapshot(Snapshot *snapshot) const
+    {
+        if (route_stream_)
+            mju_error("Bicycle: snapshots of a streaming route are not supported");
+        snapshot->current_t = current_t;
+        snapshot->current_s = current_s;
+        snapshot->current_point_i = current_point_i;
+        snapshot->start_time = start_time;
+        snapshot->last_advance = last_advance;
+        snapshot->episode_end = episode_end;
+        snapshot->path = path_;
+        snapshot->field = field_;
+        snapshot->route_file = route_file_;
+        snapshot->lookahead = lookahead_;
+
+        // The telemetry thread is idle once it caught up, and nothing pushes until the next transition
+        FlushTelemetry();
+        metrics->save(&snapshot->metrics);
+    }
+
+    void Bicycle::RestoreSnapshot(const Snapshot &snapshot, bool resume)
+    {
+        if (route_stream_)
+            mju_error("Bicycle: snapshots of a streaming route are not supported");
+        if (lookahead_.step != snapshot.lookahead.step)
+            mju_error("Bicycle: snapshot taken with another model");
+        current_t = snapshot.current_t;
+        current_s = snapshot.current_s;
+        current_point_i = snapshot.current_point_i;
+        start_time = snapshot.start_time;
+        last_advance = snapshot.last_advance;
+        episode_end = snapshot.episode_end;
+        path_ = snapshot.path;
+        field_ = snapshot.field;
+        route_file_ = snapshot.route_file;
+        if (lookahead_.size == snapshot.lookahead.size)
+            lookahead_ = snapshot.lookahead;
+        else
+            UpdateLookahead(snapshot.lookahead.time);
+        PublishProgress();
+
+        FlushTelemetry();
+        metrics->restore(snapshot.metrics, resume);
+    }
+
+    void Bicycle::SetProgress(double t, double time)
+    {
+        current_t = t;
+        current_point_i = path_->getSampleIndex(t);
+        current_s = path_->getArcLength(t);
+        UpdateLookahead(time);
+        PublishProgress();
+    }
+
+    void Bicycle::UpdateLookahead(double time)
+    {
+        // Targets advance from the current progress at the target speed, plus a fixed lead
+        double speed = residual_.parameters_[0];
+        double lead = residual_.parameters_[parameter_table_.preview_lead];
+        int n = lookahead_.size;
+        double *t = lookahead_.t.data();
+        for (int j = 0; j < n; j++)
+            t[j] = path_->getParameter(current_s + lead + speed * j * lookahead_.step);
+        double *pos = lookahead_.pos.data();
+        path_->getPoints(pos, pos + n, pos + 2 * n, t, n);
+        double *dir = lookahead_.dir.data();
+        path_->getTangents(dir, dir + n, dir + 2 * n, t, n);
+        lookahead_.time = time;
+    }
+
+    // A .route file, or a CSV with 9 doubles per line (anchor, left and right controls), which
+    // uses the converted .route beside it when that one is up to date
+    void Bicycle::LoadRoute(const std::string &file)
+    {
+        auto path = std::make_shared<Path>(50);
+        if (path->load(file) != 0)
+            mju_error("Failed to load path from %s", file.c_str());
+        if (path->getNumAnchors() < 2)
+            mju_error("Path %s needs at least two points", file.c_str());
+        path_ = std::move(path);
+        route_file_ = file;
+    }
+
+    void Bicycle::OpenRouteStream(const mjModel *model, const std::string &spec)
+    {
+        route_ahead_ = std::max((int)GetNumberOrDefault(16, model, "bicycle_route_ahead"), 1);
+        route_behind_ = std::max((int)GetNumberOrDefault(2, model, "bicycle_route_behind"), 0);
+
+        // Tailed files are relative to the experiments directory, like bicycle_route files
+        std::string resolved = spec;
+        const std::string tail = "tail:";
+        if (spec.starts_with(tail) && !std::filesystem::path(spec.substr(tail.size())).is_absolute())
+            resolved = tail + GetModelPath("bicycle/experiments/" + spec.substr(tail.size()));
+
+        route_stream_.reset();
+        std::string error;
+        route_stream_ = RouteStream::open(resolved, &error);
+        if (!route_stream_)
+            mju_error("Bicycle: %s", error.c_str());
+
+        // The first segment may take a moment to arrive, the rest of the window fills in transitions
+        const double wait = 5;
+        auto path = std::make_shared<Path>(50);
+        RouteAnchor anchor;
+        while (path->getNumAnchors() < 2 && route_stream_->wait(anchor, wait))
+            path->addPoint(anchor.p);
+        while (path->getNumAnchors() <= route_ahead_ && route_stream_->pop(anchor))
+            path->addPoint(anchor.p);
+        if (path->getNumAnchors() < 2)
+            mju_error("Bicycle: route stream %s gave no segment within %g s", spec.c_str(), wait);
+        path->buildIndex();
+        path_ = std::move(path);
+        route_file_ = spec;
+    }
+
+    // Appends the anchors that arrived and drops the ones behind, a batch of anchors at a time so the
+    // copy and the index rebuild run once per batch the rider passes rather than once per anchor.
+    // Changes go to a copy, residual functions may still read the current path
+    void Bicycle::UpdateRouteWindow()
+    {
+        const int batch = std::max(route_ahead_ / 2, 1);
+        const int rider = (int)current_t;
+        const int ahead = path_->getNumAnchors() - 1 - rider;
+        const int evict = rider - route_behind_;
+        RouteAnchor anchor;
+        bool arrived = ahead <= route_ahead_ - batch && route_stream_->pop(anchor);
+        if (!arrived && evict - path_->getFirstAnchor() < std::max(route_behind_, batch))
+            return;
+
+        auto path = std::make_shared<Path>(*path_);
+        if (arrived)
+        {
+            path->addPoint(anchor.p);
+            while (path->getNumAnchors() - 1 - rider < route_ahead_ && route_stream_->pop(anchor))
+                path->addPoint(anchor.p);
+        }
+        path->evictBefore(evict);
+        path->buildIndex();
+        path_ = std::move(path);
+    }
+
+    double Bicycle::getProjectionEnd(double t) const
+    {
+        const double horizon = std::max(lookahead_.size - 1, 0) * lookahead_.step;
+        const double speed = parameters.empty() ? 0 : std::abs(parameters[0]);
+        const double reach = kProjectionSlack + speed * horizon;
+        return std::max(path_->getParameter(path_->getArcLength(t) + reach), t);
+    }
+
+    // Copies the progress into the task's residual function, residual functions handed to the
+    // planner copy it from there in ResidualLocked. Runs under the task lock
+    void Bicycle::PublishProgress()
+    {
+        Progress &progress = residual_.progress_;
+        progress.serial++;
+        progress.path = path_;
+        progress.field = field_;
+        progress.current_t = current_t;
+        progress.t_max = getProjectionEnd(current_t);
+        progress.lookahead = lookahead_; // Same sizes after a reset, so no allocation
+    }
 
-        if ((timeout || goal_reached || fail) && sim->run) {
-            metrics->updateTrajectoryTime(start_time, now);
-            metrics->updateSuccessRate(current_point_i, curve.size()/3-1);
-            // printInfo();
-            metrics->print();
-            metrics->writeSensorData(out);
-            sim->exitrequest.store(true);
+    int SensorAdr(const mjModel *model, const char *name, bool required = true)
+    {
+        int id = mj_name2id(model, mjOBJ_SENSOR, name);
+        if (id < 0)
+        {
+            if (required)
+                mju_error("%s: sensor not found", name);
+            return -1;
         }
+        return model->sensor_adr[id];
+    }
+
+    void Bicycle::ExpandSynergies(const mjModel *model, mjData *data)
+    {
+        std::shared_lock lock(synergy_mutex);
+        auto entry = std::find_if(synergy_models.begin(), synergy_models.end(), [model](const auto &s) {
+            return s->model == model && s->nu == model->nu && s->nv == model->nv;
+        });
+        if (entry == synergy_models.end())
+        {
+            // Not a synergy model: the physics, or a model of another task
+            if (replaced_control)
+                replaced_control(model, data);
+            return;
+        }
+
+        // The planner set the synergies, a torque of gear times ctrl on their joints, which the
+        // humanoid applies through its joints
+        const SynergyModel &synergy = **entry;
+        double torque[SynergyBasis::kSynergies];
+        for (int k = 0; k < SynergyBasis::kSynergies; k++)
+        {
+            const int a = synergy.actuators[k];
+            double ctrl = data->ctrl[a];
+            if (model->actuator_ctrllimited[a])
+                ctrl = std::clamp(ctrl, model->actuator_ctrlrange[2 * a], model->actuator_ctrlrange[2 * a + 1]);
+            torque[k] = model->actuator_gear[6 * a] * ctrl;
+        }
+        synergy.basis.Apply(data, torque);
     }
 
     void Bicycle::ResetLocked(const mjModel *model)
     {
+        // Resolve sensor offsets once per model, so the hot loop never searches by name
+        sensors_.frame_subtreelinvel = SensorAdr(model, "frame_subtreelinvel");
+        sensors_.bicycle_pos = SensorAdr(model, "bicycle_pos");
+        sensors_.bicycle_xaxis = SensorAdr(model, "bicycle_xaxis");
+        sensors_.bicycle_yaxis = SensorAdr(model, "bicycle_yaxis");
+        sensors_.bicycle_zaxis = SensorAdr(model, "bicycle_zaxis");
+        sensors_.track_pos = SensorAdr(model, "track_pos");
+        sensors_.frame_subtreecom = SensorAdr(model, "frame_subtreecom");
+        sensors_.frame_frameangvel = SensorAdr(model, "frame_frameangvel");
+        sensors_.goal_pos = SensorAdr(model, "goal_pos", false);
+        sensors_.goal_zaxis = SensorAdr(model, "goal_zaxis", false);
+
+        // Route of the scene, reloaded only when it changes. The previous path stays alive in
+        // the progress copies of residual functions that are still running
+        if (path_file_.empty())
+        {
+            std::optional<std::string> route = GetCustomTextData(model, "bicycle_route");
+            if (!route)
+                mju_error("Bicycle: no path file given and no bicycle_route in the model");
+            if (route->starts_with("tail:") || route->starts_with("generate:"))
+            {
+                // Streams restart with every episode
+                OpenRouteStream(model, *route);
+            }
+            else
+            {
+                route_stream_.reset();
+                std::string file = GetModelPath("bicycle/experiments/" + *route);
+                if (file != route_file_)
+                    LoadRoute(file);
+            }
+        }
+
+        // Distance field of the route for the Field path target, cached beside the route file
+        const double field_cell = GetNumberOrDefault(0, model, "bicycle_path_field");
+        if (route_stream_ || field_cell <= 0)
+            field_.reset();
+        else if (!field_ || field_->getHash() != PathField::hash(*path_, field_cell, kFieldMargin))
+        {
+            std::string file = std::filesystem::path(route_file_).replace_extension(".field").string();
+            field_ = PathField::open(*path_, file, field_cell, kFieldMargin);
+        }
+
+        // Residual variant, its terms must match the user sensors
+        std::string variant = GetCustomTextData(model, "bicycle_residual").value_or("Path Tracking");
+        int v = 0;
+        while (v < std::ssize(kResidualVariants) && variant != kResidualVariants[v].name)
+            v++;
+        if (v == std::ssize(kResidualVariants))
+            mju_error("Bicycle: unknown residual variant %s", variant.c_str());
+        char error[256];
+        if (!kResidualVariants[v].check(model, error, sizeof(error)))
+            mju_error("Bicycle: %s residual: %s", variant.c_str(), error);
+        if (kResidualVariants[v].needs_goal && (sensors_.goal_pos < 0 || sensors_.goal_zaxis < 0))
+            mju_error("Bicycle: %s residual needs the goal_pos and goal_zaxis sensors", variant.c_str());
+        parameter_table_.residual_variant = v;
+
+        // The synergies of a planning model act through the humanoid's joints, in every step. Its
+        // basis is resolved here, once per model
+        int synergies[SynergyBasis::kSynergies];
+        if (SynergyBasis::Find(model, synergies))
+            AddSynergyModel(this, model, synergies);
+
+        parameter_table_.terminal_distance = GetNumberOrDefault(0, model, "bicycle_terminal_distance");
+        parameter_table_.preview_lead = ParameterIndex(model, "Preview Lead");
+        parameter_table_.path_target = ParameterIndex(model, "select_Path Target");
+        if (parameter_table_.preview_lead < 0 || parameter_table_.path_target < 0)
+            mju_error("Bicycle: missing Preview Lead or Path Target parameter");
+
+        // One lookahead entry per agent timestep over the horizon
+        lookahead_.step = GetNumberOrDefault(model->opt.timestep, model, "agent_timestep");
+        double horizon = GetNumberOrDefault(1.0, model, "agent_horizon");
+        lookahead_.size = (int)std::ceil(horizon / lookahead_.step) + 1;
+        lookahead_.t.assign(lookahead_.size, 0);
+        lookahead_.pos.assign(3 * lookahead_.size, 0);
+        lookahead_.dir.assign(3 * lookahead_.size, 0);
+
+        current_t = 0;
+        current_s = 0;
         current_point_i = 0;
-        metrics->reset();
-        start_time = time_point<steady_clock>::min();
-        last_advance = time_point<steady_clock>::min();
+        PublishProgress();
+        TelemetryRecord reset;
+        reset.kind = TelemetryRecord::kReset;
+        reset.max_i = path_->getNumPoints();
+        PushTelemetry(reset, true);
+        start_time = -1;
+        last_advance = -1;
+        episode_end = kEpisodeRunning;
     }
 } // namespace mjpc
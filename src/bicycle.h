@@ -1,17 +1,22 @@
 #ifndef MJPC_TASKS_BICYCLE_BICYCLE_H_
 #define MJPC_TASKS_BICYCLE_BICYCLE_H_
 
+#include <atomic>
+#include <memory>
 #include <string>
+#include <thread>
 
 #include <mujoco/mujoco.h>
 #include <fstream>
 
 #include "path.h"
+#include "path_field.h"
 #include "metrics.h"
+#include "ring_buffer.h"
+#include "route_stream.h"
+#include "stats.h"
 #include "mjpc/task.h"
 
-using namespace std::chrono;
-
 namespace mjpc
 {
   class Bicycle : public Task
@@ -19,17 +24,212 @@ namespace mjpc
   public:
     std::string Name() const override;
     std::string XmlPath() const override;
-    const Path *getPath() const { return path_; }
-    int current_point_i = 0;
-    // Experiment execution helpers
+    const Path *getPath() const { return path_.get(); }
+    // Null unless the scene sets bicycle_path_field (cell size in meters) on a route from a file
+    const PathField *getPathField() const { return field_.get(); }
+    const std::string &getRouteFile() const { return route_file_; }
+
+    // Offsets into data->sensordata, resolved once per model in ResetLocked
+    struct SensorTable
+    {
+      int frame_subtreelinvel = -1;
+      int bicycle_pos = -1;
+      int bicycle_xaxis = -1;
+      int bicycle_yaxis = -1;
+      int bicycle_zaxis = -1;
+      int track_pos = -1;
+      int frame_subtreecom = -1;
+      int frame_frameangvel = -1;
+      int goal_pos = -1;   // -1 when the scene has no goal
+      int goal_zaxis = -1; // -1 when the scene has no goal
+    };
+    const SensorTable &getSensors() const { return sensors_; }
+
+    // Indices into the residual parameters and residual settings, resolved once per model in ResetLocked
+    struct ParameterTable
+    {
+      int preview_lead = -1;
+      int path_target = -1;
+      int residual_variant = 0; // Chosen by the bicycle_residual custom text
+      double terminal_distance = 0; // bicycle_terminal_distance, 0 leaves the terminal residual off
+    };
+    const ParameterTable &getParameterTable() const { return parameter_table_; }
+
+    // Path targets over the planning horizon, rebuilt on every transition
+    struct Lookahead
+    {
+      double time = 0; // Simulation time of the first entry
+      double step = 0; // Time between entries
+      int size = 0;
+      std::vector<double> t;   // Path parameter of each entry
+      std::vector<double> pos; // x, y and z arrays of size entries each
+      std::vector<double> dir; // Unit tangents, same layout
+    };
+    const Lookahead &getLookahead() const { return lookahead_; }
+    // End of the parameter window the projection searches from t: the path the target speed
+    // covers in one planning horizon, plus kProjectionSlack meters
+    double getProjectionEnd(double t) const;
+
+    // Controls of the humanoid, the last ones of ctrl. A planning model has fewer (its crank,
+    // steer and lean), and the action term pads them with zeros in front
+    static constexpr int kHumanoidControls = 21;
+
+    // MuJoCo control callback of a model that plans with synergies (task_synergy.xml): expands
+    // the crank, steer and lean controls onto the torques of the humanoid's joints at the pose of
+    // data, in every step of the rollouts. ResetLocked resolves the basis of such a model and
+    // installs the callback once; other models go to the callback it replaced, if any, and the
+    // destructor of the last task with a synergy model restores that one
+    static void ExpandSynergies(const mjModel *model, mjData *data);
+
+    // What the residual reads from many states, one column per state
+    struct StateBatch
+    {
+      int count = 0;
+      std::vector<double> time;
+      std::vector<double> up;        // z of bicycle_yaxis
+      std::vector<double> track_pos; // x, y and z arrays of count entries each
+      std::vector<double> linvel;    // Same layout
+      std::vector<double> action;    // kHumanoidControls arrays of count entries
+      // Work columns of ResidualBatch, sized here with the batch so the residual never allocates
+      struct Scratch
+      {
+        std::vector<double> distance, dir, t, point, error;
+        std::vector<char> terminal, latched;
+      };
+      mutable Scratch scratch;
+      void resize(int n)
+      {
+        count = n;
+        time.resize(n);
+        up.resize(n);
+        track_pos.resize(3 * n);
+        linvel.resize(3 * n);
+        action.resize(kHumanoidControls * n);
+        scratch.distance.resize(n);
+        scratch.dir.resize(3 * n);
+        scratch.t.resize(n);
+        scratch.point.resize(3 * n);
+        scratch.error.resize(n);
+        scratch.terminal.resize(n);
+        scratch.latched.resize(n);
+      }
+    };
+    // Copies the state in data into column i of batch
+    void GatherState(StateBatch *batch, int i, const mjModel *model, const mjData *data) const;
+    // Writes count rows of num_residual, the same values the residual gives for each state, up to
+    // rounding. Tangents, lookahead distances and velocity errors run in AVX2 or NEON lanes over
+    // the columns (scalar on other targets); the projection stays one search per state. Returns
+    // false when the residual variant has no batched form
+    bool ResidualBatch(const StateBatch &batch, double *residual) const;
+
+    double current_t = 0;     // Path parameter of the current progress
+    double current_s = 0;     // Arc length at current_t
+    int current_point_i = 0;  // Curve sample at current_t
+    // Experiment execution helpers, times are in simulation seconds
     void printInfo();
-    Metrics *metrics; // Store metrics
+    Metrics *metrics; // Store metrics, owned by the telemetry thread, read it after FlushTelemetry
     std::ofstream out;
-    time_point<steady_clock> last_advance = time_point<steady_clock>::min(); // Last time advanced in path
-    duration<double> advance_timeout = seconds(2); // Timeout to fail task
-    time_point<steady_clock> start_time = time_point<steady_clock>::min(); // Store the task start time
+    bool print_metrics = true; // Print the metrics to stdout when the episode ends
+    bool record_every_step = false; // Record the time series on every step, not only on improvements
+    double last_advance = -1; // Last time advanced in path
+    double advance_timeout = 2; // Timeout to fail task
+    double start_time = -1; // Store the task start time
+
+    // How the episode ended, set once by TransitionLocked
+    enum EpisodeEnd
+    {
+      kEpisodeRunning = 0,
+      kEpisodeTimeout,
+      kEpisodeGoal,
+      kEpisodeFall,
+    };
+    EpisodeEnd episode_end = kEpisodeRunning;
+
+    // Task side of an episode snapshot: progress, end state, route and metrics. Save and
+    // Restore must run between planner iterations, with no transition in flight. Streaming
+    // routes cannot be rewound and are refused. The lookahead keeps the size of the current
+    // horizon and is rebuilt from the restored progress. With resume the time series goes on in
+    // the episode of the snapshot, for a reset that must not end it
+    struct Snapshot
+    {
+      double current_t = 0;
+      double current_s = 0;
+      int current_point_i = 0;
+      double start_time = -1;
+      double last_advance = -1;
+      EpisodeEnd episode_end = kEpisodeRunning;
+      std::shared_ptr<Path> path;
+      std::shared_ptr<const PathField> field;
+      std::string route_file;
+      Lookahead lookahead;
+      Metrics::State metrics;
+    };
+    void SaveSnapshot(Snapshot *snapshot) const;
+    void RestoreSnapshot(const Snapshot &snapshot, bool resume = false);
+    bool streamsRoute() const { return route_stream_ != nullptr; }
+    // Moves the progress to path parameter t and publishes it to the residual functions made
+    // after, as a transition at time would, but without metrics. For replaying recorded states
+    // between planner iterations
+    void SetProgress(double t, double time);
+
+    // Hot path counters, all zero unless built with MJPC_BICYCLE_STATS
+    StatsSnapshot getStats() const { return stats_.snapshot(); }
+    void CountPlannerIteration() const { stats_.add(kStatPlannerIterations); }
+    double stats_period = 0; // Print the counters to stderr every stats_period seconds, 0 disables
+    double last_stats = 0;   // Time of the last print
+
+    // TransitionLocked only copies what the metrics need into a record; a
+    // background thread aggregates the records and writes the time series
+    static constexpr int kTelemetryControls = 32;
+    struct TelemetryRecord
+    {
+      enum Kind
+      {
+        kSample = 0,
+        kEpisodeEnd, // start_time, time, point_i and max_i close the episode
+        kReset,      // max_i is the number of curve samples of the route
+        kStats,      // Print the counters
+      };
+      Kind kind = kSample;
+      double time = 0;       // Simulation time
+      double start_time = 0; // Time the rider started moving
+      int point_i = 0;       // Curve sample of the progress
+      int max_i = 0;
+      int first_point_i = 0; // First curve sample a streaming route still holds
+      double distance = 0;   // xy distance to the projected point
+      double target[3];
+      double site[3];
+      double com[3];
+      double euler[3];
+      double linvel[3];
+      double angvel[3];
+      int nu = 0;
+      double ctrl[kTelemetryControls];
+      double control_effort = -1; // Set when nu does not fit in ctrl
+    };
+    struct TelemetryStats
+    {
+      uint64_t pushed = 0;
+      uint64_t dropped = 0;   // Samples lost to a full ring
+      uint64_t processed = 0;
+    };
+    TelemetryStats getTelemetryStats() const;
+    // Waits until every record pushed so far reached metrics and the output file
+    void FlushTelemetry() const;
 
 
+    // Task progress the residual reads. Each residual function holds its own copy, taken under
+    // the task lock, so planner threads never see TransitionLocked halfway through an update
+    struct Progress
+    {
+      uint64_t serial = 0; // Changes on every transition
+      std::shared_ptr<const Path> path; // Kept alive while a planner thread still uses it
+      std::shared_ptr<const PathField> field;
+      double current_t = 0;
+      double t_max = 0; // End of the projection window, getProjectionEnd(current_t)
+      Lookahead lookahead;
+    };
+
     class ResidualFn : public BaseResidualFn
     {
       friend class Bicycle;
@@ -39,9 +239,16 @@ namespace mjpc
 
       void Residual(const mjModel *model, const mjData *data,
                     double *residual) const override;
+      const Progress &getProgress() const { return progress_; }
+
+    private:
+      Progress progress_;
     };
 
-    Bicycle();
+    // An empty path_file takes the route of the scene (custom text bicycle_route, relative to
+    // the experiments directory) on every reset, or streams it when the text is a RouteStream
+    // spec. An empty output_file uses the --output_file flag
+    explicit Bicycle(const std::string &path_file = "", const std::string &output_file = "");
     ~Bicycle() override;
     void TransitionLocked(mjModel *model, mjData *data) override;
     void ModifyScene(const mjModel *model, const mjData *data,
@@ -50,15 +257,70 @@ namespace mjpc
   protected:
     std::unique_ptr<mjpc::ResidualFn> ResidualLocked() const override
     {
-      return std::make_unique<ResidualFn>(this);
+      auto fn = std::make_unique<ResidualFn>(this);
+      fn->progress_ = residual_.progress_;
+      return fn;
     }
     ResidualFn *InternalResidual() override { return &residual_; }
     void ResetLocked(const mjModel *model) override;
 
   private:
     ResidualFn residual_;
-    Path *path_;
+    std::shared_ptr<Path> path_;
+    std::string path_file_;  // Constructor override of the scene route
+    std::string route_file_; // File path_ was loaded from
+    std::shared_ptr<const PathField> field_;
+    void LoadRoute(const std::string &file);
+
+    // Streaming route: path_ holds the anchors from route_behind_ before the rider to
+    // route_ahead_ after it, topped up from route_stream_ in transitions once half of route_ahead_
+    // is free, so the window is rebuilt once per batch of anchors
+    std::unique_ptr<RouteStream> route_stream_;
+    int route_ahead_ = 16;
+    int route_behind_ = 2;
+    void OpenRouteStream(const mjModel *model, const std::string &spec);
+    void UpdateRouteWindow();
+    SensorTable sensors_;
+    ParameterTable parameter_table_;
+    Lookahead lookahead_;
+    mutable TaskStats stats_;
+
+    // Path drawing cached between frames, see ModifyScene
+    struct Overlay
+    {
+      std::shared_ptr<const Path> path; // Held, so a new route never reuses its address
+      int point_i = -1;
+      std::vector<mjvGeom> curve;
+      std::vector<mjvGeom> anchors;
+    };
+    mutable Overlay overlay_;
+    void BuildOverlay() const;
+    void UpdateLookahead(double time);
+    void PublishProgress();
+
+    void PushTelemetry(const TelemetryRecord &record, bool required);
+    void TelemetryLoop();
+    void ProcessTelemetry(const TelemetryRecord &record);
+    SpscRing<TelemetryRecord> telemetry_{1024};
+    std::atomic<uint64_t> telemetry_processed_ = 0;
+    std::atomic<bool> telemetry_stop_ = false;
+    std::thread telemetry_thread_;
   };
+
+  // Meters of path searched by the projection past what the target speed covers in one horizon
+  constexpr double kProjectionSlack = 5;
+
+  // Projects the track site onto the path, searching parameters in [current_t, t_max]
+  // Returns the distance to the closest point, iterations as in Path::project
+  double getClosestPoint(double closest_point[3], double *t, const mjData *data,
+                         const Bicycle::SensorTable &sensors, const Path *path, double current_t,
+                         double t_max, int *iterations = nullptr);
+
+  // Same window as getClosestPoint, but when t_previous >= 0 (the parameter of the previous state
+  // of the same rollout) a local search starts there, which is a few Newton steps when the state
+  // moved a little along the path
+  double trackClosestPoint(double closest_point[3], double *t, const double p[3], const Path *path,
+                           double current_t, double t_max, double t_previous, int *iterations = nullptr);
 } // namespace mjpc
 
 #endif // MJPC_TASKS_BICYCLE_BICYCLE_H_
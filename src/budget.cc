@@ -0,0 +1,122 @@
+#include "mjpc/tasks/bicycle/budget.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <mujoco/mujoco.h>
+
+#include "mjpc/tasks/bicycle/runner.h"
+#include "mjpc/utilities.h"
+
+namespace mjpc
+{
+    namespace
+    {
+        // Numerics the budget changes, and the agent and the task read on reset
+        constexpr const char *kTrajectories = "sampling_trajectories";
+        constexpr const char *kHorizon = "agent_horizon";
+        constexpr const char *kSplinePoints = "sampling_spline_points";
+    } // namespace
+
+    PlannerBudget::PlannerBudget(const BudgetConfig &config, const mjModel *planning_model)
+        : config_(config), model_(mj_copyModel(nullptr, planning_model))
+    {
+        for (const char *name : {kTrajectories, kHorizon, kSplinePoints})
+            if (mj_name2id(model_, mjOBJ_NUMERIC, name) < 0)
+                mju_error("PlannerBudget: the planning model has no %s numeric", name);
+        if (config_.target_ms <= 0 || config_.window < 1 || config_.percentile <= 0 || config_.percentile > 1)
+            mju_error("PlannerBudget: invalid target, window or percentile");
+
+        trajectories_ = std::clamp((int)GetNumberOrDefault(10, model_, kTrajectories), config_.min_trajectories,
+                                   config_.max_trajectories);
+        max_horizon_ = GetNumberOrDefault(1.0, model_, kHorizon);
+        max_spline_points_ = (int)GetNumberOrDefault(3, model_, kSplinePoints);
+        horizon_ = max_horizon_;
+        spline_points_ = max_spline_points_;
+        pending_horizon_ = horizon_;
+        pending_trajectories_ = trajectories_;
+        window_.reserve(config_.window);
+    }
+
+    PlannerBudget::~PlannerBudget()
+    {
+        mj_deleteModel(model_);
+    }
+
+    bool PlannerBudget::Record(double seconds, double time)
+    {
+        window_.push_back(1e3 * seconds);
+        if ((int)window_.size() < config_.window)
+            return false;
+
+        auto nth = window_.begin() + std::min((int)(config_.percentile * window_.size()), (int)window_.size() - 1);
+        std::nth_element(window_.begin(), nth, window_.end());
+        const double measured = *nth;
+        window_.clear();
+        const double ratio = config_.target_ms / std::max(measured, 1e-6);
+        if (std::abs(ratio - 1) <= config_.deadband)
+            return false;
+
+        // Rollout time goes with samples times horizon. The horizon stays as long as it can while
+        // the samples are above their minimum, and takes effect once the agent is initialized again
+        const double product = trajectories_ * horizon_ * std::pow(ratio, config_.gain);
+        const double horizon = std::clamp(product / config_.min_trajectories,
+                                          std::min(config_.min_horizon, max_horizon_), max_horizon_);
+        const int trajectories = std::clamp((int)std::lround(product / horizon_), config_.min_trajectories,
+                                            config_.max_trajectories);
+        pending_trajectories_ = std::clamp((int)std::lround(product / horizon), config_.min_trajectories,
+                                           config_.max_trajectories);
+
+        const double percent = 100 * config_.percentile;
+        const bool changed = trajectories != trajectories_;
+        if (changed)
+        {
+            std::fprintf(stderr, "budget: %.2f s, p%.0f %.2f ms against %.2f ms, %s %d -> %d\n", time, percent,
+                         measured, config_.target_ms, kTrajectories, trajectories_, trajectories);
+            trajectories_ = trajectories;
+            adjustments_++;
+        }
+        if (std::abs(horizon - pending_horizon_) > 1e-3)
+        {
+            std::fprintf(stderr,
+                         "budget: %.2f s, p%.0f %.2f ms against %.2f ms, %s %.3f -> %.3f\n",
+                         time, percent, measured, config_.target_ms, kHorizon, pending_horizon_, horizon);
+            pending_horizon_ = horizon;
+            adjustments_++;
+        }
+        return changed;
+    }
+
+    bool PlannerBudget::ApplyPending()
+    {
+        // Samples for the same product at the new horizon; the agent reads them again when it is initialized
+        const int trajectories = pending_horizon_ != horizon_ ? pending_trajectories_ : trajectories_;
+        if (trajectories != trajectories_)
+        {
+            std::fprintf(stderr, "budget: %s %d -> %d for %s %.3f\n", kTrajectories, trajectories_, trajectories,
+                         kHorizon, pending_horizon_);
+            trajectories_ = trajectories;
+            adjustments_++;
+        }
+        const int spline_points =
+            std::clamp((int)std::lround(max_spline_points_ * pending_horizon_ / max_horizon_),
+                       std::min(config_.min_spline_points, max_spline_points_), max_spline_points_);
+        const bool changed = pending_horizon_ != horizon_ || spline_points != spline_points_;
+        if (spline_points != spline_points_)
+        {
+            std::fprintf(stderr, "budget: %s %d -> %d\n", kSplinePoints, spline_points_, spline_points);
+            adjustments_++;
+        }
+        horizon_ = pending_horizon_;
+        spline_points_ = spline_points;
+
+        char error[256];
+        const std::vector<ModelOverride> values = {
+            {kTrajectories, (double)trajectories_}, {kHorizon, horizon_}, {kSplinePoints, (double)spline_points_}};
+        if (!ApplyOverrides(model_, values, error, sizeof(error)))
+            mju_error("PlannerBudget: %s", error);
+        return changed;
+    }
+} // namespace mjpc
@@ -0,0 +1,75 @@
+#ifndef MJPC_TASKS_BICYCLE_BUDGET_H_
+#define MJPC_TASKS_BICYCLE_BUDGET_H_
+
+#include <vector>
+
+#include <mujoco/mujoco.h>
+
+// Keeps the planner's wall time per iteration under a deadline by trading samples, horizon
+// and spline points, so one configuration runs on small and large machines and on cheap and
+// expensive scenes alike
+
+namespace mjpc
+{
+  struct BudgetConfig
+  {
+    double target_ms = 20;     // Deadline of one planner iteration, e.g. agent_timestep in real time
+    double percentile = 0.9;   // Share of the iterations of a window that should meet it
+    int window = 50;           // Iterations measured before each decision
+    double deadband = 0.1;     // Relative error of the percentile left alone
+    double gain = 0.5;         // Exponent of the ratio applied per window, below 1 to damp noise
+    int min_trajectories = 4;
+    int max_trajectories = 128; // The sampling planner's limit
+    double min_horizon = 0.4;   // Seconds; the longest is agent_horizon of the model
+    int min_spline_points = 2;  // The most is sampling_spline_points of the model
+  };
+
+  // Every window iterations the percentile of their wall times is compared with the target, and
+  // the product of samples and horizon, which rollout time grows with, is scaled by a damped
+  // power of their ratio. The samples take the change down to their minimum before the horizon
+  // shortens, and the horizon grows back first. The agent and the task only read the horizon and
+  // the spline points (kept at the same density) when they are initialized, so those wait in
+  // pending() until the runner initializes them again from the numerics of a copy of the planning
+  // model (see EpisodeRunner::Step). Every adjustment is logged to stderr
+  class PlannerBudget
+  {
+  public:
+    PlannerBudget(const BudgetConfig &config, const mjModel *planning_model);
+    ~PlannerBudget();
+    PlannerBudget(const PlannerBudget &) = delete;
+    PlannerBudget &operator=(const PlannerBudget &) = delete;
+
+    // Adds the wall time of one iteration at simulation time. True when the sample count
+    // changed, read it with trajectories()
+    bool Record(double seconds, double time);
+    // True when Record chose a horizon the agent does not plan with yet
+    bool pending() const { return pending_horizon_ != horizon_; }
+    // Writes a pending horizon and spline points into model(). True when there were any, and
+    // the agent needs to be initialized again
+    bool ApplyPending();
+
+    // Copy of the planning model with the current budget in its numerics
+    const mjModel *model() const { return model_; }
+    int trajectories() const { return trajectories_; }
+    double horizon() const { return horizon_; }
+    int spline_points() const { return spline_points_; }
+    int adjustments() const { return adjustments_; }
+
+  private:
+    BudgetConfig config_;
+    mjModel *model_;
+    double max_horizon_;
+    int max_spline_points_;
+
+    int trajectories_;
+    double horizon_;
+    int spline_points_;
+    double pending_horizon_;
+    int pending_trajectories_; // Samples that go with pending_horizon_
+    int adjustments_ = 0;
+
+    std::vector<double> window_; // Milliseconds
+  };
+} // namespace mjpc
+
+#endif // MJPC_TASKS_BICYCLE_BUDGET_H_
@@ -0,0 +1,342 @@
+// Replaces the box-shaped meshes of a scene with box geoms for collision
+//
+//   bicycle_collision --scenes=stairs,track
+//
+// Each world mesh whose hull is a box (any orientation) is fitted, boxes that line up
+// into a larger box are merged, and the result is written to <scene>/collision.xml,
+// which scene.xml includes. The meshes stay in scene.xml for drawing, with contype and
+// conaffinity 0; meshes of any other shape keep colliding through their convex hull.
+// The tool then times mj_step with the meshes and with the boxes colliding.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_split.h>
+#include <mujoco/mujoco.h>
+
+#include "mjpc/tasks/bicycle/runner.h"
+
+ABSL_FLAG(std::string, scenes, "stairs,track", "Comma separated scenes whose meshes are simplified");
+ABSL_FLAG(int, steps, 2000, "Passive mj_step calls timed for each collision set");
+
+namespace
+{
+    // Geom group of the generated boxes, hidden in the viewer by default
+    constexpr int kCollisionGroup = 3;
+
+    struct Box
+    {
+        double axis[3][3]; // Rows are the box axes in world coordinates
+        double lo[3], hi[3]; // Extents along each axis
+        std::vector<std::string> meshes;
+    };
+
+    // Axes closest to x, y, z in that order, pointing the same way, right handed. Boxes
+    // fitted from different meshes then share axes whenever they are parallel
+    void CanonicalAxes(double axis[3][3])
+    {
+        double out[3][3];
+        bool used[3] = {false, false, false};
+        for (int i = 0; i < 3; i++)
+        {
+            int best = -1;
+            for (int k = 0; k < 3; k++)
+                if (!used[k] && (best < 0 || std::abs(axis[k][i]) > std::abs(axis[best][i])))
+                    best = k;
+            used[best] = true;
+            double sign = axis[best][i] < 0 ? -1 : 1;
+            for (int j = 0; j < 3; j++)
+                out[i][j] = sign * axis[best][j];
+        }
+        mju_cross(out[2], out[0], out[1]);
+        mju_copy(&axis[0][0], &out[0][0], 9);
+    }
+
+    // Fits a box to a mesh geom, false when the mesh is not one
+    bool FitBox(const mjModel *model, const mjData *data, int geom, Box *box)
+    {
+        int mesh = model->geom_dataid[geom];
+        int nvert = model->mesh_vertnum[mesh], nface = model->mesh_facenum[mesh];
+        const float *local = model->mesh_vert + 3 * model->mesh_vertadr[mesh];
+        const int *face = model->mesh_face + 3 * model->mesh_faceadr[mesh];
+
+        std::vector<double> vert(3 * nvert);
+        for (int i = 0; i < nvert; i++)
+        {
+            double v[3] = {local[3 * i], local[3 * i + 1], local[3 * i + 2]};
+            mju_mulMatVec3(&vert[3 * i], data->geom_xmat + 9 * geom, v);
+            mju_addTo3(&vert[3 * i], data->geom_xpos + 3 * geom);
+        }
+
+        // Two perpendicular face normals give the axes; the signed volume decides below
+        // whether the hull fills the box they span
+        int found = 0;
+        double volume = 0;
+        for (int f = 0; f < nface; f++)
+        {
+            const double *a = &vert[3 * face[3 * f]], *b = &vert[3 * face[3 * f + 1]], *c = &vert[3 * face[3 * f + 2]];
+            double ab[3], ac[3], normal[3];
+            mju_sub3(ab, b, a);
+            mju_sub3(ac, c, a);
+            mju_cross(normal, ab, ac);
+            double cross_bc[3];
+            mju_cross(cross_bc, b, c);
+            volume += mju_dot3(a, cross_bc) / 6;
+            if (found == 2 || mju_normalize3(normal) < mjMINVAL)
+                continue;
+            if (found == 0 || std::abs(mju_dot3(normal, box->axis[0])) < 1e-6)
+                mju_copy3(box->axis[found++], normal);
+        }
+        if (found < 2)
+            return false;
+        mju_cross(box->axis[2], box->axis[0], box->axis[1]);
+        CanonicalAxes(box->axis);
+
+        for (int k = 0; k < 3; k++)
+        {
+            box->lo[k] = mjMAXVAL;
+            box->hi[k] = -mjMAXVAL;
+            for (int i = 0; i < nvert; i++)
+            {
+                double x = mju_dot3(&vert[3 * i], box->axis[k]);
+                box->lo[k] = std::min(box->lo[k], x);
+                box->hi[k] = std::max(box->hi[k], x);
+            }
+        }
+        double extent = std::max({box->hi[0] - box->lo[0], box->hi[1] - box->lo[1], box->hi[2] - box->lo[2]});
+        double tolerance = 1e-5 * std::max(extent, 1.0);
+        for (int i = 0; i < nvert; i++)
+            for (int k = 0; k < 3; k++)
+            {
+                double x = mju_dot3(&vert[3 * i], box->axis[k]);
+                if (std::abs(x - box->lo[k]) > tolerance && std::abs(x - box->hi[k]) > tolerance)
+                    return false;
+            }
+        double box_volume = (box->hi[0] - box->lo[0]) * (box->hi[1] - box->lo[1]) * (box->hi[2] - box->lo[2]);
+        return std::abs(std::abs(volume) - box_volume) <= 1e-4 * box_volume;
+    }
+
+    // Merges pairs of boxes whose union is a box, until none is left
+    void MergeBoxes(std::vector<Box> &boxes)
+    {
+        const double tolerance = 1e-6;
+        bool merged = true;
+        while (merged)
+        {
+            merged = false;
+            for (size_t i = 0; i < boxes.size() && !merged; i++)
+                for (size_t j = i + 1; j < boxes.size() && !merged; j++)
+                {
+                    Box &a = boxes[i], &b = boxes[j];
+                    double difference[9];
+                    mju_sub(difference, &a.axis[0][0], &b.axis[0][0], 9);
+                    if (mju_norm(difference, 9) > tolerance)
+                        continue;
+                    // Same extents on two axes and touching or overlapping on the third
+                    int same = 0, joined = -1;
+                    for (int k = 0; k < 3; k++)
+                    {
+                        if (std::abs(a.lo[k] - b.lo[k]) < tolerance && std::abs(a.hi[k] - b.hi[k]) < tolerance)
+                            same++;
+                        else if (a.lo[k] <= b.hi[k] + tolerance && b.lo[k] <= a.hi[k] + tolerance)
+                            joined = k;
+                    }
+                    if (same == 3 || (same == 2 && joined >= 0))
+                    {
+                        for (int k = 0; k < 3; k++)
+                        {
+                            a.lo[k] = std::min(a.lo[k], b.lo[k]);
+                            a.hi[k] = std::max(a.hi[k], b.hi[k]);
+                        }
+                        a.meshes.insert(a.meshes.end(), b.meshes.begin(), b.meshes.end());
+                        boxes.erase(boxes.begin() + j);
+                        merged = true;
+                    }
+                }
+        }
+    }
+
+    bool WriteCollision(const std::string &file, const std::string &scene, const std::vector<Box> &boxes)
+    {
+        std::string tmp = file + ".tmp";
+        FILE *f = std::fopen(tmp.c_str(), "w");
+        if (!f)
+            return false;
+        std::fprintf(f, "<!-- Generated by bicycle_collision from the meshes of %s, do not edit -->\n", scene.c_str());
+        std::fprintf(f, "<mujoco>\n\n    <worldbody>\n");
+        for (const Box &box : boxes)
+        {
+            double pos[3] = {0, 0, 0}, size[3], frame[9], quat[4];
+            for (int k = 0; k < 3; k++)
+            {
+                mju_addToScl3(pos, box.axis[k], (box.lo[k] + box.hi[k]) / 2);
+                size[k] = (box.hi[k] - box.lo[k]) / 2;
+            }
+            mju_transpose(frame, &box.axis[0][0], 3, 3);
+            mju_mat2Quat(quat, frame);
+            std::fprintf(f, "        <!--");
+            for (const std::string &mesh : box.meshes)
+                std::fprintf(f, " %s", mesh.c_str());
+            std::fprintf(f, " -->\n        <geom type=\"box\" group=\"%d\" pos=\"%.9g %.9g %.9g\" size=\"%.9g %.9g %.9g\"",
+                         kCollisionGroup, pos[0], pos[1], pos[2], size[0], size[1], size[2]);
+            if (std::abs(quat[0]) < 1 - 1e-12)
+                std::fprintf(f, " quat=\"%.9g %.9g %.9g %.9g\"", quat[0], quat[1], quat[2], quat[3]);
+            std::fprintf(f, "/>\n");
+        }
+        std::fprintf(f, "    </worldbody>\n\n</mujoco>\n");
+        if (std::fclose(f) != 0)
+            return false;
+        std::filesystem::rename(tmp, file);
+        return true;
+    }
+
+    std::string MeshName(const mjModel *model, int geom)
+    {
+        const char *name = mj_id2name(model, mjOBJ_MESH, model->geom_dataid[geom]);
+        return name ? name : "";
+    }
+
+    bool IsWorldMesh(const mjModel *model, int geom)
+    {
+        return model->geom_bodyid[geom] == 0 && model->geom_type[geom] == mjGEOM_MESH;
+    }
+
+    bool IsCollisionBox(const mjModel *model, int geom)
+    {
+        return model->geom_bodyid[geom] == 0 && model->geom_type[geom] == mjGEOM_BOX &&
+               model->geom_group[geom] == kCollisionGroup;
+    }
+
+    // Passive steps from the initial state: microseconds per step and contacts per step
+    void TimeSteps(const mjModel *model, int steps, double *us, double *contacts)
+    {
+        mjData *data = mj_makeData(model);
+        if (model->nkey > 0)
+            mj_resetDataKeyframe(model, data, 0);
+        long total = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; i++)
+        {
+            mj_step(model, data);
+            total += data->ncon;
+        }
+        *us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / steps;
+        *contacts = (double)total / steps;
+        mj_deleteData(data);
+    }
+
+    // Copy of the model colliding with either the replaced meshes or the boxes
+    mjModel *CollisionSet(const mjModel *model, const std::set<std::string> &replaced, bool boxes)
+    {
+        mjModel *m = mj_copyModel(nullptr, model);
+        for (int g = 0; g < m->ngeom; g++)
+        {
+            bool on;
+            if (IsCollisionBox(m, g))
+                on = boxes;
+            else if (IsWorldMesh(m, g) && replaced.count(MeshName(m, g)))
+                on = !boxes;
+            else
+                continue;
+            m->geom_contype[g] = on;
+            m->geom_conaffinity[g] = on;
+        }
+        return m;
+    }
+
+    bool Simplify(const std::string &scene, int steps)
+    {
+        char error[1024] = "";
+        std::string file = mjpc::BicycleScenePath(scene, "collision.xml");
+        // scene.xml includes the file, so a first run needs an empty one to load
+        if (!std::filesystem::exists(file))
+            std::ofstream(file) << "<mujoco/>\n";
+
+        mjModel *model = mjpc::LoadBicycleModel(scene, error, sizeof(error));
+        if (!model)
+        {
+            std::fprintf(stderr, "Failed to load scene %s: %s\n", scene.c_str(), error);
+            return false;
+        }
+        mjData *data = mj_makeData(model);
+        mj_kinematics(model, data);
+
+        std::vector<Box> boxes;
+        std::vector<std::string> kept;
+        for (int g = 0; g < model->ngeom; g++)
+        {
+            if (!IsWorldMesh(model, g))
+                continue;
+            Box box;
+            if (FitBox(model, data, g, &box))
+            {
+                box.meshes.push_back(MeshName(model, g));
+                boxes.push_back(box);
+            }
+            else
+                kept.push_back(MeshName(model, g));
+        }
+        mj_deleteData(data);
+        mj_deleteModel(model);
+
+        std::set<std::string> replaced;
+        for (const Box &box : boxes)
+            replaced.insert(box.meshes.begin(), box.meshes.end());
+        size_t fitted = boxes.size();
+        MergeBoxes(boxes);
+        if (!WriteCollision(file, scene, boxes))
+        {
+            std::fprintf(stderr, "Unable to write %s\n", file.c_str());
+            return false;
+        }
+        std::printf("%s: %zu meshes as %zu boxes (%zu merged), %zu kept as hulls\n", file.c_str(), fitted,
+                    boxes.size(), fitted - boxes.size(), kept.size());
+        for (const std::string &mesh : kept)
+            std::printf("  kept %s\n", mesh.c_str());
+
+        // Reload with the new boxes and compare both collision sets
+        model = mjpc::LoadBicycleModel(scene, error, sizeof(error));
+        if (!model)
+        {
+            std::fprintf(stderr, "Failed to reload scene %s: %s\n", scene.c_str(), error);
+            return false;
+        }
+        for (int g = 0; g < model->ngeom; g++)
+            if (IsWorldMesh(model, g) && replaced.count(MeshName(model, g)) &&
+                (model->geom_contype[g] || model->geom_conaffinity[g]))
+                std::printf("  mesh %s still collides, set contype=\"0\" conaffinity=\"0\" in scene.xml\n",
+                            MeshName(model, g).c_str());
+
+        double us[2], contacts[2];
+        for (int boxes_on = 0; boxes_on < 2; boxes_on++)
+        {
+            mjModel *m = CollisionSet(model, replaced, boxes_on);
+            TimeSteps(m, steps, &us[boxes_on], &contacts[boxes_on]);
+            mj_deleteModel(m);
+        }
+        mj_deleteModel(model);
+        std::printf("  mj_step: meshes %.1f us (%.1f contacts), boxes %.1f us (%.1f contacts), %.2fx\n",
+                    us[0], contacts[0], us[1], contacts[1], us[1] > 0 ? us[0] / us[1] : 0);
+        return true;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    absl::ParseCommandLine(argc, argv);
+    std::vector<std::string> scenes = absl::StrSplit(absl::GetFlag(FLAGS_scenes), ',', absl::SkipWhitespace());
+
+    int failed = 0;
+    for (const std::string &scene : scenes)
+        failed += !Simplify(scene, absl::GetFlag(FLAGS_steps));
+    return failed ? 1 : 0;
+}
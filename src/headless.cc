@@ -0,0 +1,248 @@
+// Runs Bicycle episodes without a window, printing one CSV row of metrics per episode
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_split.h>
+#include <mujoco/mujoco.h>
+
+#include "mjpc/tasks/bicycle/bicycle.h"
+#include "mjpc/tasks/bicycle/reduced_rider.h"
+#include "mjpc/tasks/bicycle/runner.h"
+#include "mjpc/threadpool.h"
+#include "mjpc/utilities.h"
+
+ABSL_FLAG(std::string, output_file, "bicycle.bin", "Binary file for the time series of every episode, "
+          "with a _<model> suffix when there are several --planning_models");
+ABSL_FLAG(std::string, scene, "straight", "Scene directory under bicycle/experiments");
+ABSL_FLAG(int, episodes, 1, "Number of episodes to run");
+ABSL_FLAG(double, max_time, 120, "Simulation seconds before an episode is cut off");
+ABSL_FLAG(int, threads, 0, "Planner threads, 0 for all available");
+ABSL_FLAG(double, stats_period, 0, "Print the hot path counters to stderr every this many simulation seconds "
+          "(needs a build with MJPC_BICYCLE_STATS)");
+ABSL_FLAG(bool, check_batch, false, "Compare the batched residual against per-state calls on the recent states");
+ABSL_FLAG(bool, record_every_step, false, "Record the time series on every step instead of only on improvements");
+ABSL_FLAG(double, branch_distance, 0, "Simulate the first this many meters of the path once, then start every "
+          "episode from a snapshot of that state. 0 starts every episode from the home keyframe");
+ABSL_FLAG(std::string, planning_models, "full", "Comma separated models the agent plans with, each running all the "
+          "episodes: full (the simulated model), reduced (task_reduced.xml, a rigid rider) or synergy "
+          "(task_synergy.xml, the humanoid driven by crank, steer and lean synergies). The controls of the last two "
+          "are mapped onto the humanoid motors");
+ABSL_FLAG(double, budget_ms, 0, "Adapt sampling_trajectories at once, and agent_horizon and sampling_spline_points at "
+          "the next step (the next episode with a streamed route), so the planner iteration meets this many "
+          "milliseconds. 0 keeps the model values");
+ABSL_FLAG(double, budget_percentile, 0.9, "Share of the planner iterations that should meet --budget_ms");
+ABSL_FLAG(int, budget_window, 50, "Planner iterations measured before each budget adjustment");
+
+namespace
+{
+    // Keeps the last kStates states of the episode and, once they are all new, evaluates them
+    // with the batched residual and with one residual call each, tracking the largest difference
+    class BatchCheck
+    {
+    public:
+        static constexpr int kStates = 32;
+
+        BatchCheck(const mjModel *model, std::shared_ptr<mjpc::Bicycle> task)
+            : task_(task), spec_(mjSTATE_INTEGRATION), size_(mj_stateSize(model, spec_)),
+              states_(kStates * size_), data_(mj_makeData(model))
+        {
+            batch_.resize(kStates);
+        }
+        ~BatchCheck() { mj_deleteData(data_); }
+
+        void operator()(const mjModel *model, const mjData *data)
+        {
+            mj_getState(model, data, &states_[stored_ * size_], spec_);
+            if (++stored_ < kStates)
+                return;
+            stored_ = 0;
+
+            auto fn = task_->Residual();
+            int dim = task_->num_residual;
+            std::vector<double> expected(kStates * dim), batched(kStates * dim);
+            for (int i = 0; i < kStates; i++)
+            {
+                mj_setState(model, data_, &states_[i * size_], spec_);
+                mj_forward(model, data_);
+                task_->GatherState(&batch_, i, model, data_);
+                fn->Residual(model, data_, &expected[i * dim]);
+            }
+            if (!task_->ResidualBatch(batch_, batched.data()))
+                return;
+            for (int k = 0; k < kStates * dim; k++)
+                max_difference_ = std::max(max_difference_, std::abs(expected[k] - batched[k]));
+            checked_ += kStates;
+        }
+
+        void Print() const
+        {
+            std::fprintf(stderr, "batched residual: %d states, max difference %g\n", checked_, max_difference_);
+        }
+
+    private:
+        std::shared_ptr<mjpc::Bicycle> task_;
+        unsigned int spec_;
+        int size_;
+        std::vector<double> states_;
+        mjData *data_;
+        mjpc::Bicycle::StateBatch batch_;
+        int stored_ = 0;
+        int checked_ = 0;
+        double max_difference_ = 0;
+    };
+} // namespace
+
+int main(int argc, char **argv)
+{
+    absl::ParseCommandLine(argc, argv);
+    std::string scene = absl::GetFlag(FLAGS_scene);
+
+    char error[1024] = "";
+    mjModel *model = mjpc::LoadBicycleModel(scene, error, sizeof(error));
+    if (!model)
+    {
+        std::fprintf(stderr, "Failed to load scene %s: %s\n", scene.c_str(), error);
+        return 1;
+    }
+
+    int threads = absl::GetFlag(FLAGS_threads);
+    mjpc::ThreadPool pool(threads > 0 ? threads : mjpc::NumAvailableHardwareThreads());
+    const double max_time = absl::GetFlag(FLAGS_max_time);
+    const double branch_distance = absl::GetFlag(FLAGS_branch_distance);
+
+    // Totals of each planning model, for the comparison at the end
+    struct Summary
+    {
+        std::string planning_model;
+        double trajectory_error = 0;
+        double plan_time = 0;
+        int steps = 0;
+        int episodes = 0;
+    };
+    std::vector<Summary> summaries;
+
+    std::vector<std::string> planning_models =
+        absl::StrSplit(absl::GetFlag(FLAGS_planning_models), ',', absl::SkipWhitespace());
+    mjpc::PrintEpisodeHeader();
+    for (const std::string &planning_model : planning_models)
+    {
+        mjModel *reduced = nullptr;
+        if (planning_model == "reduced" || planning_model == "synergy")
+        {
+            reduced = mjpc::LoadPlanningModel(model, scene, "task_" + planning_model + ".xml", error, sizeof(error));
+            if (!reduced)
+            {
+                std::fprintf(stderr, "Failed to load the %s model of %s: %s\n", planning_model.c_str(), scene.c_str(),
+                             error);
+                mj_deleteModel(model);
+                return 1;
+            }
+        }
+        else if (planning_model != "full")
+        {
+            std::fprintf(stderr, "Unknown planning model %s\n", planning_model.c_str());
+            mj_deleteModel(model);
+            return 1;
+        }
+
+        // Each planning model writes its own time series when there are several
+        std::string output_file = absl::GetFlag(FLAGS_output_file);
+        if (planning_models.size() > 1)
+        {
+            std::filesystem::path path(output_file);
+            path.replace_filename(path.stem().string() + "_" + planning_model + path.extension().string());
+            output_file = path.string();
+        }
+        auto task = std::make_shared<mjpc::Bicycle>("", output_file);
+        task->record_every_step = absl::GetFlag(FLAGS_record_every_step);
+        task->stats_period = absl::GetFlag(FLAGS_stats_period);
+
+        // One agent and mjData for all the episodes of a planning model, reset or restored between them
+        mjpc::EpisodeRunner runner(model, task, &pool, reduced);
+        if (absl::GetFlag(FLAGS_budget_ms) > 0)
+        {
+            mjpc::BudgetConfig budget;
+            budget.target_ms = absl::GetFlag(FLAGS_budget_ms);
+            budget.percentile = absl::GetFlag(FLAGS_budget_percentile);
+            budget.window = absl::GetFlag(FLAGS_budget_window);
+            runner.SetBudget(budget);
+        }
+        mjpc::EpisodeRunner::Snapshot prefix;
+        if (branch_distance > 0)
+        {
+            while (task->current_s < branch_distance && runner.Step(max_time))
+            {
+            }
+            if (task->episode_end != mjpc::Bicycle::kEpisodeRunning)
+            {
+                std::fprintf(stderr, "The episode ended before %g m\n", branch_distance);
+                mj_deleteModel(reduced);
+                mj_deleteModel(model);
+                return 1;
+            }
+            runner.Save(&prefix);
+            std::fprintf(stderr, "Branching from %.2f m at %.2f s\n", task->current_s, runner.data()->time);
+        }
+
+        Summary summary;
+        summary.planning_model = planning_model;
+        for (int i = 0; i < absl::GetFlag(FLAGS_episodes); i++)
+        {
+            if (branch_distance > 0)
+                runner.Restore(prefix);
+            else if (i > 0)
+                runner.Reset();
+
+            mjpc::StepCallback on_step;
+            std::shared_ptr<BatchCheck> check;
+            if (absl::GetFlag(FLAGS_check_batch))
+            {
+                check = std::make_shared<BatchCheck>(model, task);
+                on_step = [check](const mjModel *m, const mjData *d) { (*check)(m, d); };
+            }
+            mjpc::EpisodeResult result = runner.Run(max_time, on_step);
+            result.scene = scene;
+            result.planning_model = planning_model;
+            mjpc::PrintEpisode(result);
+            if (check)
+                check->Print();
+
+            summary.trajectory_error += result.trajectory_error;
+            summary.plan_time += result.plan_time;
+            summary.steps += result.steps;
+            summary.episodes++;
+        }
+        if (const mjpc::PlannerBudget *budget = runner.budget())
+            std::fprintf(stderr, "budget: %s ended at %d trajectories, %.3f s horizon, %d spline points after %d "
+                         "adjustments\n", planning_model.c_str(), budget->trajectories(), budget->horizon(),
+                         budget->spline_points(), budget->adjustments());
+        summaries.push_back(summary);
+        mj_deleteModel(reduced);
+    }
+
+    // Tracking error and planner time of every model against the first one
+    if (summaries.size() > 1)
+    {
+        const Summary &base = summaries[0];
+        auto error = [](const Summary &s) { return s.episodes > 0 ? s.trajectory_error / s.episodes : 0.0; };
+        auto plan_ms = [](const Summary &s) { return s.steps > 0 ? 1e3 * s.plan_time / s.steps : 0.0; };
+        for (const Summary &s : summaries)
+        {
+            std::fprintf(stderr, "%s: trajectory error %e (%+.1f%% against %s), planner %.3f ms per step (%.2fx)\n",
+                         s.planning_model.c_str(), error(s),
+                         error(base) > 0 ? 100 * (error(s) - error(base)) / error(base) : 0.0,
+                         base.planning_model.c_str(), plan_ms(s), plan_ms(s) > 0 ? plan_ms(base) / plan_ms(s) : 0.0);
+        }
+    }
+
+    mj_deleteModel(model);
+    return 0;
+}
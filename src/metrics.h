@@ -4,10 +4,14 @@
 
 #ifndef METRICS_H
 #define METRICS_H
-#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <memory>
 #include <iostream>
 #include <absl/strings/str_format.h>
 
+#include "telemetry.h"
+
 struct Point {
     double x;
     double y;
@@ -17,8 +21,6 @@ struct Point {
 typedef std::vector<Point> Points;
 typedef std::vector<double> Scalars;
 
-using namespace std::chrono;
-
 class Metrics {
 
 public:
@@ -30,16 +32,33 @@ public:
 
     ~Metrics()= default;
 
-    bool updateTrajectoryError(const std::vector<double> &path, const int current_point_i, const double current_distance) {
-        const double best_distance = _closest_distance[current_point_i];
+    bool updateTrajectoryError(const int current_point_i, const double current_distance) {
+        if (current_point_i < _first_point)
+            return false;
+        const size_t i = current_point_i - _first_point;
+        if (i >= _closest_distance.size())
+            _closest_distance.resize(i + 1, 0);
+        const double best_distance = _closest_distance[i];
         if (current_distance < best_distance || best_distance == 0) {
-            _closest_distance[current_point_i] = current_distance;
+            _closest_distance[i] = current_distance;
             return true;
         }
         return false;
     }
 
-    void updateTrajectoryTime(const time_point<steady_clock> startTime, const time_point<steady_clock> endTime) {
+    // Samples before first_point can no longer improve (a streaming route dropped them), so
+    // their distances are added to a running sum and forgotten
+    void settleBefore(const int first_point) {
+        while (_first_point < first_point && !_closest_distance.empty()) {
+            _settled_error += _closest_distance.front();
+            _closest_distance.pop_front();
+            _first_point++;
+        }
+        _first_point = std::max(_first_point, first_point);
+    }
+
+    // Start and end of the run, in simulation time
+    void updateTrajectoryTime(const double startTime, const double endTime) {
         _start_time = startTime;
         _end_time = endTime;
     }
@@ -49,10 +68,53 @@ public:
         _max_i = max_i;
     }
 
-    void reset() {
-        std::ranges::fill(_closest_distance, 0);
-        _start_time = time_point<steady_clock>::min();
-        _end_time = time_point<steady_clock>::min();
+    // The route may change between episodes, n_points is the sample count of the new one
+    void reset(const size_t n_points) {
+        if (_telemetry)
+            _telemetry->setEpisode(++_episode);
+        _closest_distance.assign(n_points, 0);
+        _first_point = 0;
+        _settled_error = 0;
+        _start_time = -1;
+        _end_time = -1;
+    }
+
+    // Everything the metrics aggregate, without the time series writer
+    struct State {
+        std::deque<double> closest_distance;
+        int first_point = 0;
+        double settled_error = 0;
+        double start_time = -1;
+        double end_time = -1;
+        int final_point_i = -1;
+        int max_i = -1;
+        int episode = 0;
+    };
+
+    void save(State *state) const {
+        state->closest_distance = _closest_distance;
+        state->first_point = _first_point;
+        state->settled_error = _settled_error;
+        state->start_time = _start_time;
+        state->end_time = _end_time;
+        state->final_point_i = _final_point_i;
+        state->max_i = _max_i;
+        state->episode = _episode;
+    }
+
+    // Continues from a saved state, the rows after it go to a new episode of the time series. With
+    // resume they go on in the episode of the state, which nothing else wrote to since the save
+    void restore(const State &state, const bool resume = false) {
+        _episode = resume ? state.episode : _episode + 1;
+        if (_telemetry)
+            _telemetry->setEpisode(_episode);
+        _closest_distance = state.closest_distance;
+        _first_point = state.first_point;
+        _settled_error = state.settled_error;
+        _start_time = state.start_time;
+        _end_time = state.end_time;
+        _final_point_i = state.final_point_i;
+        _max_i = state.max_i;
     }
 
     void printPoints(Points &points) {
@@ -84,7 +146,7 @@ public:
     }
 
     double getTrajectoryError() const {
-        double res = 0;
+        double res = _settled_error;
         for (const double dist : _closest_distance) {
            res += dist;
         }
@@ -92,67 +154,68 @@ public:
     }
 
     double getTrajectoryTime() const {
-        const auto elapsed = _end_time - _start_time;
-        return duration_cast<microseconds>(elapsed).count() / 1e6;
+        return _end_time - _start_time;
     }
 
     double getSuccessRate() const {
         return static_cast<double>(_final_point_i) / static_cast<double>(_max_i);
     }
 
+    // Streams the time series to os in chunks of chunk_rows, see telemetry.h for the format
+    void openTimeSeries(std::ostream &os, uint32_t chunk_rows = 1024) {
+        static const std::vector<std::string> columns = {
+            "time",
+            "site.x", "site.y", "site.z",
+            "com.x", "com.y", "com.z",
+            "euler.x", "euler.y", "euler.z",
+            "linear.x", "linear.y", "linear.z",
+            "angular.x", "angular.y", "angular.z",
+            "target.x", "target.y", "target.z",
+            "control_effort",
+        };
+        _telemetry = std::make_unique<TelemetryWriter>(os, columns, chunk_rows);
+    }
+
     void updateTimeSeriesData(Point site, Point com, Point euler, Point linear, Point angular, Point targetPoint, double control_efford, double time) {
-        _siteTrajectory.emplace_back(site);
-        _centreOfMassTrajectory.emplace_back(com);
-        _eulerAngles.emplace_back(euler);
-        _linearVelocity.emplace_back(linear);
-        _angularVelocity.emplace_back(angular);
-        _targetPoint.emplace_back(targetPoint);
-        _controlEfford.emplace_back(control_efford);
-        _time.emplace_back(time);
-    }
-
-    // Write all the sensor data to a binary ostream and returns the size of each array
-    void writeSensorData(std::ostream &os) const {
-        unsigned long size = _siteTrajectory.size();
-        os.write(reinterpret_cast<const char *>(&size), sizeof(size));
-        unsigned long point_size = sizeof(Point);
-        os.write(reinterpret_cast<const char *>(&point_size), sizeof(point_size));
-
-        unsigned long data_size = sizeof(Point) * size;
-        os.write(reinterpret_cast<const char *>(_siteTrajectory.data()), data_size);
-        os.write(reinterpret_cast<const char *>(_centreOfMassTrajectory.data()), data_size);
-        os.write(reinterpret_cast<const char *>(_eulerAngles.data()), data_size);
-        os.write(reinterpret_cast<const char *>(_linearVelocity.data()), data_size);
-        os.write(reinterpret_cast<const char *>(_angularVelocity.data()), data_size);
-        os.write(reinterpret_cast<const char *>(_targetPoint.data()), data_size);
-
-        os.write(reinterpret_cast<const char *>(_controlEfford.data()), sizeof(double) * size);
-        os.write(reinterpret_cast<const char *>(_time.data()), sizeof(double) * size);
+        if (!_telemetry)
+            return;
+        const double row[] = {
+            time,
+            site.x, site.y, site.z,
+            com.x, com.y, com.z,
+            euler.x, euler.y, euler.z,
+            linear.x, linear.y, linear.z,
+            angular.x, angular.y, angular.z,
+            targetPoint.x, targetPoint.y, targetPoint.z,
+            control_efford,
+        };
+        _telemetry->append(row);
+    }
+
+    // Writes the rows still buffered, so the run is complete on disk
+    void flushTimeSeries() const {
+        if (_telemetry)
+            _telemetry->flush();
     }
 
 private:
 
-    // Trajectory Error
-    std::vector<double> _closest_distance;
+    // Trajectory Error, best distance per curve sample from _first_point on
+    std::deque<double> _closest_distance;
+    int _first_point = 0;
+    double _settled_error = 0;
 
     // Trajectory Time
-    steady_clock::time_point _start_time = time_point<steady_clock>::min();
-    steady_clock::time_point _end_time = time_point<steady_clock>::min();
+    double _start_time = -1;
+    double _end_time = -1;
 
     // SuccessRate
     int _final_point_i = -1;
     int _max_i = -1;
 
     // Time series
-    Points _siteTrajectory;
-    Points _centreOfMassTrajectory;
-    Points _eulerAngles;
-    Points _linearVelocity;
-    Points _angularVelocity;
-    Points _targetPoint;
-
-    std::vector<double> _controlEfford;
-    std::vector<double> _time;
+    std::unique_ptr<TelemetryWriter> _telemetry;
+    uint32_t _episode = 0;
 };
 
 
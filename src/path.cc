@@ -1,15 +1,35 @@
 #include "path.h"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <filesystem>
 #include <iostream>
+#include <iterator>
 #include <fstream>
 #include <string>
 #include <sstream>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "_deps/mujoco-src/src/engine/engine_util_errmem.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 Path::Path(unsigned int n_segments) : n_segments_(n_segments) {
 
 }
@@ -25,46 +45,426 @@ void Path::addPoint(const double p[9])
     if(points_.size() < 2)
         return;
 
-    for(unsigned int i = 0; i <= n_segments_; i++) {
-        double t0 = (double)i/n_segments_ + points_.size()-2;
-        double a[3];
-        getPoint(a, t0);
-        curve_.push_back(a[0]);
-        curve_.push_back(a[1]);
-        curve_.push_back(a[2]);
+    // Power basis of the new segment
+    const Point &a = points_[points_.size() - 2];
+    const Point &b = points_[points_.size() - 1];
+    const double p0[3] = {a.x, a.y, a.z};
+    const double p1[3] = {a.bx, a.by, a.bz};
+    const double p2[3] = {b.ax, b.ay, b.az};
+    const double p3[3] = {b.x, b.y, b.z};
+    for(int k = 0; k < 3; k++) {
+        coef_[k][0].push_back(p0[k]);
+        coef_[k][1].push_back(3 * (p1[k] - p0[k]));
+        coef_[k][2].push_back(3 * (p2[k] - 2 * p1[k] + p0[k]));
+        coef_[k][3].push_back(p3[k] - 3 * p2[k] + 3 * p1[k] - p0[k]);
+    }
+
+    int count = n_segments_ + 1;
+    std::vector<double> t(count), xyz(3 * count);
+    for(int i = 0; i < count; i++)
+        t[i] = (double)i/n_segments_ + first_anchor_ + points_.size()-2;
+    getPoints(xyz.data(), xyz.data() + count, xyz.data() + 2 * count, t.data(), count);
+
+    size_t start = curve_.size();
+    curve_.resize(start + 3 * count);
+    for(int i = 0; i < count; i++) {
+        curve_[start + i * 3 + 0] = xyz[i];
+        curve_[start + i * 3 + 1] = xyz[count + i];
+        curve_[start + i * 3 + 2] = xyz[2 * count + i];
     }
 }
 
-std::vector<double> Path::getCurve() const {
-    return curve_;
+void Path::getPoints(double *x, double *y, double *z, const double *t, int count) const
+{
+    double *out[3] = {x, y, z};
+    const double n = (double)coef_[0][0].size();
+    const double first = first_anchor_;
+    int i = 0;
+
+#if defined(__AVX2__)
+    const __m256d base = _mm256_set1_pd(first);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d last = _mm256_set1_pd(n - 1);
+    const __m256d end = _mm256_set1_pd(n);
+    for(; i + 4 <= count; i += 4) {
+        __m256d ti = _mm256_min_pd(_mm256_max_pd(_mm256_sub_pd(_mm256_loadu_pd(t + i), base), zero), end);
+        __m256d seg = _mm256_min_pd(_mm256_floor_pd(ti), last);
+        __m256d u = _mm256_sub_pd(ti, seg);
+        __m128i idx = _mm256_cvttpd_epi32(seg);
+        // Sorted parameters mostly share a segment, where a broadcast beats a gather
+        int s0 = _mm_cvtsi128_si32(idx);
+        bool shared = _mm_movemask_epi8(_mm_cmpeq_epi32(idx, _mm_set1_epi32(s0))) == 0xffff;
+        for(int k = 0; k < 3; k++) {
+            __m256d r = shared ? _mm256_set1_pd(coef_[k][3][s0]) : _mm256_i32gather_pd(coef_[k][3].data(), idx, 8);
+            for(int d = 2; d >= 0; d--) {
+                __m256d c = shared ? _mm256_set1_pd(coef_[k][d][s0]) : _mm256_i32gather_pd(coef_[k][d].data(), idx, 8);
+#if defined(__FMA__)
+                r = _mm256_fmadd_pd(r, u, c);
+#else
+                r = _mm256_add_pd(_mm256_mul_pd(r, u), c);
+#endif
+            }
+            _mm256_storeu_pd(out[k] + i, r);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float64x2_t base = vdupq_n_f64(first);
+    const float64x2_t zero = vdupq_n_f64(0);
+    const float64x2_t last = vdupq_n_f64(n - 1);
+    const float64x2_t end = vdupq_n_f64(n);
+    for(; i + 2 <= count; i += 2) {
+        float64x2_t ti = vminq_f64(vmaxq_f64(vsubq_f64(vld1q_f64(t + i), base), zero), end);
+        float64x2_t seg = vminq_f64(vrndmq_f64(ti), last);
+        float64x2_t u = vsubq_f64(ti, seg);
+        int s0 = (int)vgetq_lane_f64(seg, 0);
+        int s1 = (int)vgetq_lane_f64(seg, 1);
+        for(int k = 0; k < 3; k++) {
+            const double *c3 = coef_[k][3].data();
+            float64x2_t r = vsetq_lane_f64(c3[s1], vdupq_n_f64(c3[s0]), 1);
+            for(int d = 2; d >= 0; d--) {
+                const double *cd = coef_[k][d].data();
+                float64x2_t c = vsetq_lane_f64(cd[s1], vdupq_n_f64(cd[s0]), 1);
+                r = vfmaq_f64(c, r, u);
+            }
+            vst1q_f64(out[k] + i, r);
+        }
+    }
+#endif
+
+    // Scalar tail, and the whole batch on other targets
+    for(; i < count; i++) {
+        double ti = std::clamp(t[i] - first, 0.0, n);
+        int seg = std::min((int)ti, (int)n - 1);
+        double u = ti - seg;
+        for(int k = 0; k < 3; k++)
+            out[k][i] = ((coef_[k][3][seg] * u + coef_[k][2][seg]) * u + coef_[k][1][seg]) * u + coef_[k][0][seg];
+    }
 }
 
 int Path::loadFromFile(std::string& path)
 {
-	std::ifstream file(path);
-	if (file.is_open())
+	// Whole file in one read, then strtod in place
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
 	{
-		std::string line;
-		while (std::getline(file, line))
-		{
-			std::istringstream iss(line);
-			double p[9];
-			for (int i = 0; i < 9; i++)
-			{
-				std::string val;
-				std::getline(iss, val, ',');
-				p[i] = std::stod(val);
-			}
-
-			addPoint(p);
-		}
-		file.close();
-		std::cout << "Loaded " << getNumAnchors() << " points from " << path << std::endl;
-		return 0;
-	} else {
 		std::cerr << "Unable to open file " << path << std::endl;
 		return 1;
 	}
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	const char *c = text.c_str();
+	const char *end = c + text.size();
+	size_t lines = std::count(text.begin(), text.end(), '\n') + 1;
+	points_.reserve(points_.size() + lines);
+	curve_.reserve(curve_.size() + lines * 3 * (n_segments_ + 1));
+	int line = 0;
+	while (c < end)
+	{
+		line++;
+		while (c < end && (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n'))
+			c++;
+		if (c == end)
+			break;
+		double p[9];
+		if (!parseAnchor(c, end, p))
+		{
+			std::cerr << "Bad value on line " << line << " of " << path << std::endl;
+			return 1;
+		}
+		addPoint(p);
+	}
+	buildIndex();
+	std::cerr << "Loaded " << getNumAnchors() << " points from " << path << std::endl;
+	return 0;
+}
+
+bool Path::parseAnchor(const char *&c, const char *end, double p[9])
+{
+    for(int i = 0; i < 9; i++) {
+        char *next;
+        p[i] = std::strtod(c, &next);
+        if(next == c)
+            return false;
+        c = next;
+        while(c < end && (*c == ' ' || *c == '\t' || (*c == ',' && i < 8)))
+            c++;
+    }
+    return true;
+}
+
+int Path::load(const std::string &file)
+{
+    std::filesystem::path source(file);
+    if(source.extension() == ".route")
+        return loadBinary(file);
+
+    // A converted copy next to the CSV skips the parsing and the index build
+    std::error_code error;
+    std::filesystem::path route = std::filesystem::path(source).replace_extension(".route");
+    auto route_time = std::filesystem::last_write_time(route, error);
+    if(!error && route_time >= std::filesystem::last_write_time(source, error) && !error &&
+       loadBinary(route.string()) == 0)
+        return 0;
+
+    std::string csv = file;
+    return loadFromFile(csv);
+}
+
+// Binary route ----------------------------------------------------------------------------------------------------
+//
+// Little-endian, every table 8-byte aligned so that a mapping of the file is read in place
+// (see PathTable). Files are replaced by rename, so a running process keeps its old mapping:
+//   RouteHeader  magic "BCRT", version, sizes of the sampling and the index, then one
+//                {offset, count} entry per table, offsets from the start of the file
+//   anchors      9 doubles per anchor, as in the CSV
+//   curve        the sampled curve, 3 doubles per sample
+//   coef         power basis, 12 rows (axis, degree) of one double per segment
+//   arc_length, arc_parameter, bounds   doubles, as built by buildIndex
+//   grid_start, grid_segments           int32
+
+namespace {
+
+enum RouteTable {
+    kRouteAnchors = 0,
+    kRouteCurve,
+    kRouteCoef,
+    kRouteArcLength,
+    kRouteArcParameter,
+    kRouteBounds,
+    kRouteGridStart,
+    kRouteGridSegments,
+    kRouteTables,
+};
+
+struct RouteHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t samples_per_segment;
+    uint32_t arc_resolution;
+    int32_t grid_nx, grid_ny;
+    double arc_step;
+    double grid_origin[2];
+    double grid_cell;
+    struct {
+        uint64_t offset, count;
+    } table[kRouteTables];
+};
+
+constexpr uint32_t kRouteVersion = 1;
+static_assert(std::endian::native == std::endian::little, "binary routes are little-endian");
+static_assert(sizeof(RouteHeader) % 8 == 0);
+static_assert(sizeof(int) == sizeof(int32_t), "grid tables are stored as int32");
+
+// Read-only view of a whole file, mapped where the platform allows it
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &file) {
+#if defined(_WIN32)
+        std::ifstream in(file, std::ios::binary);
+        if(!in.is_open())
+            return;
+        buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#else
+        int fd = open(file.c_str(), O_RDONLY);
+        if(fd < 0)
+            return;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(map != MAP_FAILED) {
+                data_ = static_cast<const char *>(map);
+                size_ = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#if !defined(_WIN32)
+        if(data_)
+            munmap(const_cast<char *>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    std::vector<char> buffer_;
+#endif
+};
+
+} // namespace
+
+int Path::saveBinary(const std::string &file) const
+{
+    const int n = (int)points_.size() - 1;
+    if(n < 1 || first_anchor_ != 0) {
+        std::cerr << "Not saving a route without segments or with evicted anchors to " << file << std::endl;
+        return 1;
+    }
+
+    std::vector<double> anchors(points_.size() * 9), coef(12 * n);
+    for(size_t i = 0; i < points_.size(); i++) {
+        const Point &point = points_[i];
+        const double d[9] = {point.x, point.y, point.z, point.ax, point.ay, point.az, point.bx, point.by, point.bz};
+        std::copy(d, d + 9, &anchors[i * 9]);
+    }
+    for(int k = 0; k < 3; k++)
+        for(int d = 0; d < 4; d++)
+            std::copy(coef_[k][d].begin(), coef_[k][d].end(), &coef[(k * 4 + d) * n]);
+
+    const struct {
+        const void *data;
+        size_t count, size;
+    } tables[kRouteTables] = {
+        {anchors.data(), anchors.size(), 8},
+        {curve_.data(), curve_.size(), 8},
+        {coef.data(), coef.size(), 8},
+        {arc_length_.data(), arc_length_.size(), 8},
+        {arc_parameter_.data(), arc_parameter_.size(), 8},
+        {bounds_.data(), bounds_.size(), 8},
+        {grid_start_.data(), grid_start_.size(), 4},
+        {grid_segments_.data(), grid_segments_.size(), 4},
+    };
+
+    RouteHeader header = {};
+    std::memcpy(header.magic, "BCRT", 4);
+    header.version = kRouteVersion;
+    header.samples_per_segment = n_segments_;
+    header.arc_resolution = arc_resolution_;
+    header.grid_nx = grid_nx_;
+    header.grid_ny = grid_ny_;
+    header.arc_step = arc_step_;
+    header.grid_origin[0] = grid_origin_[0];
+    header.grid_origin[1] = grid_origin_[1];
+    header.grid_cell = grid_cell_;
+    uint64_t offset = sizeof(RouteHeader);
+    for(int i = 0; i < kRouteTables; i++) {
+        header.table[i] = {offset, tables[i].count};
+        offset += (tables[i].count * tables[i].size + 7) / 8 * 8;
+    }
+
+    // Written beside the target and renamed, so a reader never maps a partial file. The name is unique
+    // per process and call, other runs may write the same route meanwhile
+    static std::atomic<unsigned int> calls = 0;
+    std::string temporary = file + "." + std::to_string(getpid()) + "_" + std::to_string(calls++) + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    const char zeros[8] = {};
+    for(const auto &table : tables) {
+        size_t bytes = table.count * table.size;
+        out.write(static_cast<const char *>(table.data), bytes);
+        out.write(zeros, (8 - bytes % 8) % 8);
+    }
+    out.close();
+    std::error_code error;
+    if(!out.good() || (std::filesystem::rename(temporary, file, error), error)) {
+        std::filesystem::remove(temporary, error);
+        std::cerr << "Unable to write route " << file << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int Path::loadBinary(const std::string &file)
+{
+    auto mapping = std::make_shared<MappedFile>(file);
+    const MappedFile &map = *mapping;
+    if(!map.data()) {
+        std::cerr << "Unable to open file " << file << std::endl;
+        return 1;
+    }
+    auto fail = [&file](const char *reason) {
+        std::cerr << "Bad route " << file << ": " << reason << std::endl;
+        return 1;
+    };
+
+    RouteHeader header;
+    if(map.size() < sizeof(header))
+        return fail("truncated header");
+    std::memcpy(&header, map.data(), sizeof(header));
+    if(std::memcmp(header.magic, "BCRT", 4) != 0)
+        return fail("not a route file");
+    if(header.version != kRouteVersion)
+        return fail("unsupported version");
+    if(header.arc_resolution != arc_resolution_ || header.samples_per_segment != n_segments_)
+        return fail("sampling does not match this path");
+    // Every lookup divides by these, a bad value would send the searches out of the tables
+    if(!std::isfinite(header.grid_cell) || header.grid_cell <= 0 || !std::isfinite(header.arc_step) ||
+       header.arc_step <= 0 || !std::isfinite(header.grid_origin[0]) || !std::isfinite(header.grid_origin[1]))
+        return fail("bad index geometry");
+
+    const size_t sizes[kRouteTables] = {8, 8, 8, 8, 8, 8, 4, 4};
+    for(int i = 0; i < kRouteTables; i++) {
+        const auto &table = header.table[i];
+        if(table.offset % 8 != 0 || table.offset > map.size() || table.count > (map.size() - table.offset) / sizes[i])
+            return fail("table out of bounds");
+    }
+
+    // The tables must agree with each other before anything is copied
+    auto size = [&](RouteTable t) { return header.table[t].count; };
+    const uint64_t anchors = size(kRouteAnchors) / 9;
+    const uint64_t n = anchors - 1;
+    const uint64_t cells = (uint64_t)std::max(header.grid_nx, 0) * (uint64_t)std::max(header.grid_ny, 0);
+    if(anchors < 2 || size(kRouteAnchors) % 9 != 0 || size(kRouteCoef) != 12 * n ||
+       size(kRouteCurve) != 3 * n * (header.samples_per_segment + 1) ||
+       size(kRouteArcLength) != n * arc_resolution_ + 1 || size(kRouteArcParameter) < 2 ||
+       size(kRouteBounds) != 6 * n || cells == 0 || size(kRouteGridStart) != cells + 1)
+        return fail("inconsistent tables");
+
+    auto table = [&](RouteTable t) { return map.data() + header.table[t].offset; };
+    auto doubles = [&](RouteTable t) { return reinterpret_cast<const double *>(table(t)); };
+    const int32_t *grid_start = reinterpret_cast<const int32_t *>(table(kRouteGridStart));
+    const int32_t *grid_segments = reinterpret_cast<const int32_t *>(table(kRouteGridSegments));
+    // Cell c lists grid_segments[grid_start[c], grid_start[c + 1]), which must stay inside the table
+    if(grid_start[0] != 0 || (uint64_t)grid_start[cells] != size(kRouteGridSegments))
+        return fail("inconsistent tables");
+    for(uint64_t c = 0; c < cells; c++)
+        if(grid_start[c + 1] < grid_start[c] || (uint64_t)grid_start[c + 1] > size(kRouteGridSegments))
+            return fail("inconsistent tables");
+    for(uint64_t i = 0; i < size(kRouteGridSegments); i++)
+        if(grid_segments[i] < 0 || (uint64_t)grid_segments[i] >= n)
+            return fail("segment index out of range");
+    // Arc length lookups bisect this table
+    const double *arc_length = doubles(kRouteArcLength);
+    for(uint64_t i = 0; i < size(kRouteArcLength); i++)
+        if(!std::isfinite(arc_length[i]) || (i > 0 && arc_length[i] < arc_length[i - 1]))
+            return fail("arc length not monotone");
+
+    // Nothing is parsed or rebuilt, the tables point into the mapping and pages are read on first use
+    points_.clear();
+    points_.reserve(anchors);
+    for(uint64_t i = 0; i < anchors; i++)
+        points_.emplace_back(doubles(kRouteAnchors) + i * 9);
+    first_anchor_ = 0;
+    first_length_ = 0;
+    curve_.view(doubles(kRouteCurve), size(kRouteCurve));
+    for(int k = 0; k < 3; k++)
+        for(int d = 0; d < 4; d++)
+            coef_[k][d].view(doubles(kRouteCoef) + (k * 4 + d) * n, n);
+    arc_length_.view(doubles(kRouteArcLength), size(kRouteArcLength));
+    arc_parameter_.view(doubles(kRouteArcParameter), size(kRouteArcParameter));
+    arc_step_ = header.arc_step;
+    bounds_.view(doubles(kRouteBounds), size(kRouteBounds));
+    grid_origin_[0] = header.grid_origin[0];
+    grid_origin_[1] = header.grid_origin[1];
+    grid_cell_ = header.grid_cell;
+    grid_nx_ = header.grid_nx;
+    grid_ny_ = header.grid_ny;
+    grid_start_.view(grid_start, cells + 1);
+    grid_segments_.view(grid_segments, size(kRouteGridSegments));
+    mapping_ = std::move(mapping);
+    std::cerr << "Loaded " << getNumAnchors() << " points from " << file << std::endl;
+    return 0;
 }
 
 void print3d(const double p[3]) {
@@ -74,7 +474,7 @@ void print3d(const double p[3]) {
 void Path::getPoint(double p[3], double t) const
 {
     double index;
-    double t0 = std::modf(t, &index);
+    double t0 = std::modf(std::max(t - first_anchor_, 0.0), &index);
     int i = (int)index;
     if(i >= points_.size() - 1)
     {
@@ -83,6 +483,7 @@ void Path::getPoint(double p[3], double t) const
     }
 
     double p0[3], p1[3], a0[3], a1[3];
+    i += first_anchor_;
     getAnchor(p0, i);
     getAnchor(p1, i + 1);
     getRightControl(a0, i);
@@ -102,7 +503,7 @@ void Path::getPoint(double p[3], double t) const
 
 void Path::getAnchor(double p[3], int i) const
 {
-    const Point &point = points_[i];
+    const Point &point = points_[i - first_anchor_];
     p[0] = point.x;
     p[1] = point.y;
     p[2] = point.z;
@@ -110,7 +511,7 @@ void Path::getAnchor(double p[3], int i) const
 
 void Path::getLeftControl(double a[3], int i) const
 {
-    const Point &point = points_[i];
+    const Point &point = points_[i - first_anchor_];
     a[0] = point.ax;
     a[1] = point.ay;
     a[2] = point.az;
@@ -118,7 +519,7 @@ void Path::getLeftControl(double a[3], int i) const
 
 void Path::getRightControl(double a[3], int i) const
 {
-    const Point &point = points_[i];
+    const Point &point = points_[i - first_anchor_];
     a[0] = point.bx;
     a[1] = point.by;
     a[2] = point.bz;
@@ -130,3 +531,551 @@ void Path::lerp(double p[3], const double p0[3], const double p1[3], const doubl
     p[1] = p0[1] + t * (p1[1] - p0[1]);
     p[2] = p0[2] + t * (p1[2] - p0[2]);
 }
+
+int Path::getSampleIndex(double t) const
+{
+    double index;
+    double u = std::modf(std::max(t - first_anchor_, 0.0), &index);
+    int segment = (int)index;
+    if(segment >= (int)points_.size() - 1)
+    {
+        segment = points_.size() - 2;
+        u = 1;
+    }
+    return (first_anchor_ + segment) * (n_segments_ + 1) + (int)std::lround(u * n_segments_);
+}
+
+// Bezier point, first and second derivatives of a segment at local parameter u
+void Path::evalSegment(double b[3], double d1[3], double d2[3], int segment, double u) const
+{
+    const Point &a = points_[segment];
+    const Point &c = points_[segment + 1];
+    const double p0[3] = {a.x, a.y, a.z};
+    const double p1[3] = {a.bx, a.by, a.bz};
+    const double p2[3] = {c.ax, c.ay, c.az};
+    const double p3[3] = {c.x, c.y, c.z};
+
+    double v = 1 - u;
+    for(int k = 0; k < 3; k++) {
+        b[k] = v*v*v*p0[k] + 3*v*v*u*p1[k] + 3*v*u*u*p2[k] + u*u*u*p3[k];
+        d1[k] = 3*v*v*(p1[k] - p0[k]) + 6*v*u*(p2[k] - p1[k]) + 3*u*u*(p3[k] - p2[k]);
+        d2[k] = 6*v*(p2[k] - 2*p1[k] + p0[k]) + 6*u*(p3[k] - 2*p2[k] + p1[k]);
+    }
+}
+
+// Lower bound of the distance between p and a segment, from its bounding box
+double Path::boundsDistance(const double p[3], int segment) const
+{
+    const double *box = &bounds_[segment * 6];
+    double d2 = 0;
+    for(int k = 0; k < 3; k++) {
+        double d = std::max({box[k] - p[k], 0.0, p[k] - box[k + 3]});
+        d2 += d * d;
+    }
+    return std::sqrt(d2);
+}
+
+namespace {
+
+// Distance from p to the line segment from a to b
+double chordDistance(const double p[3], const double a[3], const double b[3])
+{
+    double ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    double ap[3] = {p[0] - a[0], p[1] - a[1], p[2] - a[2]};
+    double len2 = ab[0]*ab[0] + ab[1]*ab[1] + ab[2]*ab[2];
+    double s = len2 > 0 ? std::clamp((ap[0]*ab[0] + ap[1]*ab[1] + ap[2]*ab[2]) / len2, 0.0, 1.0) : 0;
+    double e[3] = {ap[0] - s * ab[0], ap[1] - s * ab[1], ap[2] - s * ab[2]};
+    return std::sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+}
+
+} // namespace
+
+// Segments whose box is closer than dist are bounded again by the chord of the piece in the
+// interval: its Bezier control points, from the derivatives at the piece ends, stay within r
+// of the chord, and so does the whole piece
+bool Path::noneCloser(const double p[3], double dist, double t_min, double t_max) const
+{
+    int n = (int)points_.size() - 1;
+    t_min = std::clamp(t_min - first_anchor_, 0.0, (double)std::max(n, 0));
+    t_max = std::clamp(t_max - first_anchor_, t_min, (double)std::max(n, 0));
+    if(n < 1 || t_max <= t_min)
+        return true;
+    int s0 = std::min((int)t_min, n - 1);
+    int s1 = std::min((int)t_max, n - 1);
+    for(int segment = s0; segment <= s1; segment++) {
+        double u0 = segment == s0 ? t_min - s0 : 0;
+        double u1 = segment == s1 ? t_max - s1 : 1;
+        if(u1 <= u0 || boundsDistance(p, segment) >= dist)
+            continue;
+        double b0[3], b1[3], d0[3], d1[3], d2[3];
+        evalSegment(b0, d0, d2, segment, u0);
+        evalSegment(b1, d1, d2, segment, u1);
+        const double h = (u1 - u0) / 3;
+        const double c0[3] = {b0[0] + h * d0[0], b0[1] + h * d0[1], b0[2] + h * d0[2]};
+        const double c1[3] = {b1[0] - h * d1[0], b1[1] - h * d1[1], b1[2] - h * d1[2]};
+        double r = std::max(chordDistance(c0, b0, b1), chordDistance(c1, b0, b1));
+        if(chordDistance(p, b0, b1) - r < dist)
+            return false;
+    }
+    return true;
+}
+
+// Coarse sampling followed by Newton iterations on (B(u) - p) . B'(u) = 0
+double Path::projectSegment(double q[3], double *u, const double p[3], int segment, double u_min, double u_max,
+                            int *iterations) const
+{
+    const int n_coarse = 12;
+    const int n_newton = 8;
+    double b[3], d1[3], d2[3];
+
+    double best_u = u_min;
+    double best_dist = INFINITY;
+    for(int i = 0; i <= n_coarse; i++) {
+        double ui = u_min + (u_max - u_min) * i / n_coarse;
+        evalSegment(b, d1, d2, segment, ui);
+        double dist = (b[0]-p[0])*(b[0]-p[0]) + (b[1]-p[1])*(b[1]-p[1]) + (b[2]-p[2])*(b[2]-p[2]);
+        if(dist < best_dist) {
+            best_dist = dist;
+            best_u = ui;
+        }
+    }
+
+    double ui = best_u;
+    int steps = 0;
+    for(int i = 0; i < n_newton; i++) {
+        steps++;
+        evalSegment(b, d1, d2, segment, ui);
+        double r[3] = {b[0] - p[0], b[1] - p[1], b[2] - p[2]};
+        double g = r[0]*d1[0] + r[1]*d1[1] + r[2]*d1[2];
+        double jtj = d1[0]*d1[0] + d1[1]*d1[1] + d1[2]*d1[2];
+        double h = jtj + r[0]*d2[0] + r[1]*d2[1] + r[2]*d2[2];
+        if(h < 0.1 * jtj)
+            h = jtj; // Gauss-Newton step where the full Hessian is not positive
+        if(h <= 0)
+            break;
+        double next = std::clamp(ui - g / h, u_min, u_max);
+        if(std::abs(next - ui) < 1e-9) {
+            ui = next;
+            break;
+        }
+        ui = next;
+    }
+    if(iterations)
+        *iterations += steps;
+
+    evalSegment(b, d1, d2, segment, ui);
+    double dist = (b[0]-p[0])*(b[0]-p[0]) + (b[1]-p[1])*(b[1]-p[1]) + (b[2]-p[2])*(b[2]-p[2]);
+    if(dist > best_dist) {
+        ui = best_u;
+        evalSegment(b, d1, d2, segment, ui);
+        dist = best_dist;
+    }
+
+    q[0] = b[0];
+    q[1] = b[1];
+    q[2] = b[2];
+    *u = ui;
+    return std::sqrt(dist);
+}
+
+void Path::buildIndex()
+{
+    buildArcLength();
+
+    int n = (int)points_.size() - 1;
+    bounds_.assign(std::max(n, 0) * 6, 0);
+    grid_start_.clear();
+    grid_segments_.clear();
+    grid_nx_ = grid_ny_ = 0;
+    if(n < 1)
+        return;
+
+    // A cubic Bezier segment lies inside the convex hull of its control points
+    double lo[2] = {INFINITY, INFINITY}, hi[2] = {-INFINITY, -INFINITY};
+    double extent = 0;
+    for(int i = 0; i < n; i++) {
+        const Point &a = points_[i];
+        const Point &c = points_[i + 1];
+        const double ctrl[4][3] = {{a.x, a.y, a.z}, {a.bx, a.by, a.bz}, {c.ax, c.ay, c.az}, {c.x, c.y, c.z}};
+        double *box = &bounds_[i * 6];
+        for(int k = 0; k < 3; k++) {
+            box[k] = std::min({ctrl[0][k], ctrl[1][k], ctrl[2][k], ctrl[3][k]});
+            box[k + 3] = std::max({ctrl[0][k], ctrl[1][k], ctrl[2][k], ctrl[3][k]});
+        }
+        for(int k = 0; k < 2; k++) {
+            lo[k] = std::min(lo[k], box[k]);
+            hi[k] = std::max(hi[k], box[k + 3]);
+        }
+        extent += std::max(box[3] - box[0], box[4] - box[1]);
+    }
+
+    // Cells about the size of an average segment, capped to keep the grid small
+    const int max_cells = 1 << 20;
+    grid_cell_ = std::max(extent / n, 1e-3);
+    while((hi[0] - lo[0]) / grid_cell_ * (hi[1] - lo[1]) / grid_cell_ > max_cells)
+        grid_cell_ *= 2;
+    grid_origin_[0] = lo[0];
+    grid_origin_[1] = lo[1];
+    grid_nx_ = (int)((hi[0] - lo[0]) / grid_cell_) + 1;
+    grid_ny_ = (int)((hi[1] - lo[1]) / grid_cell_) + 1;
+
+    // Bucket the segments by the cells their boxes overlap (counting pass, then fill)
+    grid_start_.assign(grid_nx_ * grid_ny_ + 1, 0);
+    for(int pass = 0; pass < 2; pass++) {
+        std::vector<int> fill;
+        if(pass == 1) {
+            for(int c = 0; c < grid_nx_ * grid_ny_; c++)
+                grid_start_[c + 1] += grid_start_[c];
+            grid_segments_.resize(grid_start_.back());
+            fill.assign(grid_start_.begin(), grid_start_.end() - 1);
+        }
+        for(int i = 0; i < n; i++) {
+            const double *box = &bounds_[i * 6];
+            int x0 = (int)((box[0] - lo[0]) / grid_cell_), x1 = (int)((box[3] - lo[0]) / grid_cell_);
+            int y0 = (int)((box[1] - lo[1]) / grid_cell_), y1 = (int)((box[4] - lo[1]) / grid_cell_);
+            for(int y = y0; y <= y1; y++)
+                for(int x = x0; x <= x1; x++) {
+                    int c = y * grid_nx_ + x;
+                    if(pass == 0)
+                        grid_start_[c + 1]++;
+                    else
+                        grid_segments_[fill[c]++] = i;
+                }
+        }
+    }
+}
+
+double Path::project(double q[3], double *t, const double p[3], double t_min, double t_max, int *iterations) const
+{
+    double dist = projectWindow(q, t, p, t_min - first_anchor_, t_max - first_anchor_, iterations);
+    *t += first_anchor_;
+    return dist;
+}
+
+// project over the anchors held, with parameters counted from points_[0]
+double Path::projectWindow(double q[3], double *t, const double p[3], double t_min, double t_max,
+                           int *iterations) const
+{
+    int n = (int)points_.size() - 1;
+    t_min = std::clamp(t_min, 0.0, (double)n);
+    t_max = std::clamp(t_max, t_min, (double)n);
+    int s0 = std::min((int)t_min, n - 1);
+    int s1 = std::min((int)t_max, n - 1);
+
+    double best = INFINITY;
+    auto visit = [&](int segment) {
+        if(segment < s0 || segment > s1 || boundsDistance(p, segment) >= best)
+            return;
+        double u_min = segment == s0 ? t_min - s0 : 0;
+        double u_max = segment == s1 ? t_max - s1 : 1;
+        double qi[3], u;
+        double dist = projectSegment(qi, &u, p, segment, u_min, u_max, iterations);
+        if(dist < best || (dist == best && segment + u < *t)) {
+            best = dist;
+            *t = segment + u;
+            q[0] = qi[0];
+            q[1] = qi[1];
+            q[2] = qi[2];
+        }
+    };
+
+    // Short windows are cheaper to scan directly, starting next to t_min
+    const int max_linear = 8;
+    if(s1 - s0 < max_linear || grid_nx_ == 0) {
+        for(int segment = s0; segment <= s1; segment++)
+            visit(segment);
+        return best;
+    }
+
+    // Seed with the segment at t_min, then search rings of cells around p until
+    // no unvisited cell can be closer than the best distance
+    visit(s0);
+    int cx = std::clamp((int)((p[0] - grid_origin_[0]) / grid_cell_), 0, grid_nx_ - 1);
+    int cy = std::clamp((int)((p[1] - grid_origin_[1]) / grid_cell_), 0, grid_ny_ - 1);
+    int max_ring = std::max({cx, grid_nx_ - 1 - cx, cy, grid_ny_ - 1 - cy});
+    for(int r = 0; r <= max_ring && (r - 1) * grid_cell_ < best; r++) {
+        for(int y = cy - r; y <= cy + r; y++) {
+            if(y < 0 || y >= grid_ny_)
+                continue;
+            int step = (y == cy - r || y == cy + r) ? 1 : 2 * r;
+            for(int x = cx - r; x <= cx + r; x += std::max(step, 1)) {
+                if(x < 0 || x >= grid_nx_)
+                    continue;
+                int c = y * grid_nx_ + x;
+                for(int k = grid_start_[c]; k < grid_start_[c + 1]; k++)
+                    visit(grid_segments_[k]);
+            }
+        }
+    }
+    return best;
+}
+
+// Newton iterations on the global parameter from t_guess, free to cross segment ends but kept
+// inside [t_min, t_max]. Only finds the local minimum next to t_guess, callers check the ends
+double Path::refine(double q[3], double *t, const double p[3], double t_guess, double t_min, double t_max,
+                    int *iterations) const
+{
+    const int max_steps = 12;
+    int n = (int)points_.size() - 1;
+    t_min = std::clamp(t_min - first_anchor_, 0.0, (double)n);
+    t_max = std::clamp(t_max - first_anchor_, t_min, (double)n);
+    double ti = std::clamp(t_guess - first_anchor_, t_min, t_max);
+    double b[3], d1[3], d2[3];
+    int segment, steps = 0;
+    double u;
+    for(int i = 0; i < max_steps; i++) {
+        steps++;
+        locate(&segment, &u, ti);
+        evalSegment(b, d1, d2, segment, u);
+        double r[3] = {b[0] - p[0], b[1] - p[1], b[2] - p[2]};
+        double g = r[0]*d1[0] + r[1]*d1[1] + r[2]*d1[2];
+        double jtj = d1[0]*d1[0] + d1[1]*d1[1] + d1[2]*d1[2];
+        double h = jtj + r[0]*d2[0] + r[1]*d2[1] + r[2]*d2[2];
+        if(h < 0.1 * jtj)
+            h = jtj;
+        if(h <= 0)
+            break;
+        // At most half a segment per step, the cubic of one segment says little about the next
+        double next = std::clamp(std::clamp(ti - g / h, ti - 0.5, ti + 0.5), t_min, t_max);
+        if(std::abs(next - ti) < 1e-9) {
+            ti = next;
+            break;
+        }
+        ti = next;
+    }
+    if(iterations)
+        *iterations += steps;
+
+    locate(&segment, &u, ti);
+    evalSegment(b, d1, d2, segment, u);
+    q[0] = b[0];
+    q[1] = b[1];
+    q[2] = b[2];
+    *t = ti + first_anchor_;
+    return std::sqrt((b[0]-p[0])*(b[0]-p[0]) + (b[1]-p[1])*(b[1]-p[1]) + (b[2]-p[2])*(b[2]-p[2]));
+}
+
+// Splits a parameter counted from points_[0] into segment and local parameter, clamped to the path
+void Path::locate(int *segment, double *u, double t) const
+{
+    int n = (int)points_.size() - 1;
+    if(t <= 0) {
+        *segment = 0;
+        *u = 0;
+    } else if(t >= n) {
+        *segment = n - 1;
+        *u = 1;
+    } else {
+        *segment = (int)t;
+        *u = t - *segment;
+    }
+}
+
+void Path::getDerivatives(double d1[3], double d2[3], double t) const
+{
+    int segment;
+    double u, b[3];
+    locate(&segment, &u, t - first_anchor_);
+    evalSegment(b, d1, d2, segment, u);
+}
+
+void Path::getTangent(double d[3], double t) const
+{
+    double d2[3];
+    getDerivatives(d, d2, t);
+    double norm = std::sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    if(norm < 1e-12)
+        return;
+    d[0] /= norm;
+    d[1] /= norm;
+    d[2] /= norm;
+}
+
+void Path::getTangents(double *x, double *y, double *z, const double *t, int count) const
+{
+    double *out[3] = {x, y, z};
+    const double n = (double)coef_[0][0].size();
+    const double first = first_anchor_;
+    int i = 0;
+
+    // Same lanes as getPoints, the derivative (3 c3 u + 2 c2) u + c1 then divided by its norm
+#if defined(__AVX2__)
+    const __m256d base = _mm256_set1_pd(first);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d last = _mm256_set1_pd(n - 1);
+    const __m256d end = _mm256_set1_pd(n);
+    const __m256d one = _mm256_set1_pd(1), two = _mm256_set1_pd(2), three = _mm256_set1_pd(3);
+    const __m256d tiny = _mm256_set1_pd(1e-12);
+    for(; i + 4 <= count; i += 4) {
+        __m256d ti = _mm256_min_pd(_mm256_max_pd(_mm256_sub_pd(_mm256_loadu_pd(t + i), base), zero), end);
+        __m256d seg = _mm256_min_pd(_mm256_floor_pd(ti), last);
+        __m256d u = _mm256_sub_pd(ti, seg);
+        __m128i idx = _mm256_cvttpd_epi32(seg);
+        int s0 = _mm_cvtsi128_si32(idx);
+        bool shared = _mm_movemask_epi8(_mm_cmpeq_epi32(idx, _mm_set1_epi32(s0))) == 0xffff;
+        __m256d d[3];
+        __m256d norm2 = zero;
+        for(int k = 0; k < 3; k++) {
+            auto coef = [&](int degree) {
+                return shared ? _mm256_set1_pd(coef_[k][degree][s0])
+                              : _mm256_i32gather_pd(coef_[k][degree].data(), idx, 8);
+            };
+            __m256d r = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(three, coef(3)), u), _mm256_mul_pd(two, coef(2)));
+            d[k] = _mm256_add_pd(_mm256_mul_pd(r, u), coef(1));
+            norm2 = _mm256_add_pd(norm2, _mm256_mul_pd(d[k], d[k]));
+        }
+        __m256d norm = _mm256_sqrt_pd(norm2);
+        __m256d scale = _mm256_blendv_pd(_mm256_div_pd(one, norm), one, _mm256_cmp_pd(norm, tiny, _CMP_LT_OQ));
+        for(int k = 0; k < 3; k++)
+            _mm256_storeu_pd(out[k] + i, _mm256_mul_pd(d[k], scale));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float64x2_t base = vdupq_n_f64(first);
+    const float64x2_t zero = vdupq_n_f64(0);
+    const float64x2_t last = vdupq_n_f64(n - 1);
+    const float64x2_t end = vdupq_n_f64(n);
+    const float64x2_t one = vdupq_n_f64(1), two = vdupq_n_f64(2), three = vdupq_n_f64(3);
+    const float64x2_t tiny = vdupq_n_f64(1e-12);
+    for(; i + 2 <= count; i += 2) {
+        float64x2_t ti = vminq_f64(vmaxq_f64(vsubq_f64(vld1q_f64(t + i), base), zero), end);
+        float64x2_t seg = vminq_f64(vrndmq_f64(ti), last);
+        float64x2_t u = vsubq_f64(ti, seg);
+        int s0 = (int)vgetq_lane_f64(seg, 0);
+        int s1 = (int)vgetq_lane_f64(seg, 1);
+        float64x2_t d[3];
+        float64x2_t norm2 = zero;
+        for(int k = 0; k < 3; k++) {
+            auto coef = [&](int degree) {
+                const double *c = coef_[k][degree].data();
+                return vsetq_lane_f64(c[s1], vdupq_n_f64(c[s0]), 1);
+            };
+            float64x2_t r = vfmaq_f64(vmulq_f64(two, coef(2)), vmulq_f64(three, coef(3)), u);
+            d[k] = vfmaq_f64(coef(1), r, u);
+            norm2 = vfmaq_f64(norm2, d[k], d[k]);
+        }
+        float64x2_t norm = vsqrtq_f64(norm2);
+        float64x2_t scale = vbslq_f64(vcltq_f64(norm, tiny), one, vdivq_f64(one, norm));
+        for(int k = 0; k < 3; k++)
+            vst1q_f64(out[k] + i, vmulq_f64(d[k], scale));
+    }
+#endif
+
+    // Scalar tail, and the whole batch on other targets
+    for(; i < count; i++) {
+        double ti = std::clamp(t[i] - first, 0.0, n);
+        int seg = std::min((int)ti, (int)n - 1);
+        double u = ti - seg;
+        double d[3];
+        for(int k = 0; k < 3; k++)
+            d[k] = (3 * coef_[k][3][seg] * u + 2 * coef_[k][2][seg]) * u + coef_[k][1][seg];
+        double norm = std::sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        double scale = norm < 1e-12 ? 1 : 1 / norm;
+        for(int k = 0; k < 3; k++)
+            out[k][i] = d[k] * scale;
+    }
+}
+
+// |B' x B''| / |B'|^3
+double Path::getCurvature(double t) const
+{
+    double d1[3], d2[3];
+    getDerivatives(d1, d2, t);
+    double c[3] = {d1[1]*d2[2] - d1[2]*d2[1], d1[2]*d2[0] - d1[0]*d2[2], d1[0]*d2[1] - d1[1]*d2[0]};
+    double speed = std::sqrt(d1[0]*d1[0] + d1[1]*d1[1] + d1[2]*d1[2]);
+    if(speed < 1e-12)
+        return 0;
+    return std::sqrt(c[0]*c[0] + c[1]*c[1] + c[2]*c[2]) / (speed * speed * speed);
+}
+
+void Path::buildArcLength()
+{
+    int n = (int)points_.size() - 1;
+    arc_length_.clear();
+    arc_parameter_.clear();
+    if(n < 1)
+        return;
+
+    // Chord length over a fine sampling of every segment
+    arc_length_.resize(n * arc_resolution_ + 1);
+    arc_length_[0] = first_length_;
+    double prev[3], b[3], d1[3], d2[3];
+    evalSegment(prev, d1, d2, 0, 0);
+    for(int segment = 0; segment < n; segment++) {
+        for(int j = 1; j <= arc_resolution_; j++) {
+            evalSegment(b, d1, d2, segment, (double)j / arc_resolution_);
+            double dx = b[0] - prev[0], dy = b[1] - prev[1], dz = b[2] - prev[2];
+            int k = segment * arc_resolution_ + j;
+            arc_length_[k] = arc_length_[k - 1] + std::sqrt(dx*dx + dy*dy + dz*dz);
+            prev[0] = b[0];
+            prev[1] = b[1];
+            prev[2] = b[2];
+        }
+    }
+
+    // Inverse table, so that t(s) is a direct lookup
+    const int max_steps = 1 << 22;
+    double length = arc_length_.back() - first_length_;
+    arc_step_ = 0.05;
+    while(length / arc_step_ > max_steps)
+        arc_step_ *= 2;
+    int steps = (int)(length / arc_step_) + 1;
+    arc_parameter_.resize(steps + 1);
+    int k = 0;
+    for(int i = 0; i <= steps; i++) {
+        double s = first_length_ + std::min(i * arc_step_, length);
+        while(k < (int)arc_length_.size() - 2 && arc_length_[k + 1] < s)
+            k++;
+        double ds = arc_length_[k + 1] - arc_length_[k];
+        double f = ds > 0 ? (s - arc_length_[k]) / ds : 0;
+        arc_parameter_[i] = (k + std::clamp(f, 0.0, 1.0)) / arc_resolution_;
+    }
+}
+
+double Path::getArcLength(double t) const
+{
+    if(arc_length_.empty())
+        return 0;
+    double x = std::clamp(t - first_anchor_, 0.0, (double)(points_.size() - 1)) * arc_resolution_;
+    int k = std::min((int)x, (int)arc_length_.size() - 2);
+    return arc_length_[k] + (x - k) * (arc_length_[k + 1] - arc_length_[k]);
+}
+
+double Path::getParameter(double s) const
+{
+    if(arc_parameter_.empty())
+        return 0;
+    s = std::clamp(s, first_length_, getLength());
+    double x = (s - first_length_) / arc_step_;
+    int i = std::min((int)x, (int)arc_parameter_.size() - 2);
+    double t = arc_parameter_[i] + (x - i) * (arc_parameter_[i + 1] - arc_parameter_[i]);
+
+    // The coarse estimate lands within a step or so of the right fine interval
+    int last = (int)arc_length_.size() - 2;
+    int k = std::min((int)(t * arc_resolution_), last);
+    while(k > 0 && arc_length_[k] > s)
+        k--;
+    while(k < last && arc_length_[k + 1] < s)
+        k++;
+    double ds = arc_length_[k + 1] - arc_length_[k];
+    double f = ds > 0 ? (s - arc_length_[k]) / ds : 0;
+    return first_anchor_ + (k + std::clamp(f, 0.0, 1.0)) / arc_resolution_;
+}
+
+void Path::evictBefore(int anchor)
+{
+    int k = std::min(anchor - first_anchor_, (int)points_.size() - 2);
+    if(k <= 0)
+        return;
+
+    // Arc length of the new first anchor, the table may predate the last appends
+    if((size_t)k * arc_resolution_ >= arc_length_.size())
+        buildArcLength();
+    first_length_ = arc_length_[k * arc_resolution_];
+
+    points_.erase(points_.begin(), points_.begin() + k);
+    for(auto &axis : coef_)
+        for(auto &row : axis)
+            row.eraseFront(k);
+    curve_.eraseFront((size_t)k * (n_segments_ + 1) * 3);
+    first_anchor_ += k;
+}
@@ -1,12 +1,82 @@
 #ifndef PATH_H
 #define PATH_H
 
+#include <algorithm>
+#include <memory>
+#include <span>
 #include <vector>
 #include <string>
 
+// Array of a path table, either owned or a view into a mapped route file. The view
+// is read in place; the first write copies it into owned storage
+template <typename T>
+class PathTable {
+
+public:
+    PathTable() = default;
+    PathTable(const PathTable &other) { *this = other; }
+    PathTable &operator=(const PathTable &other) {
+        owned_ = other.owned_;
+        if(other.viewing())
+            view(other.data_, other.size_);
+        else
+            sync();
+        return *this;
+    }
+
+    const T &operator[](size_t i) const { return data_[i]; }
+    T &operator[](size_t i) { own(); return owned_[i]; }
+    const T *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const T &back() const { return data_[size_ - 1]; }
+    const T *begin() const { return data_; }
+    const T *end() const { return data_ + size_; }
+
+    void push_back(const T &value) { own(); owned_.push_back(value); sync(); }
+    void resize(size_t n) { own(); owned_.resize(n); sync(); }
+    void reserve(size_t n) { own(); owned_.reserve(n); sync(); }
+    void assign(size_t n, const T &value) { owned_.assign(n, value); sync(); }
+    void clear() { owned_.clear(); sync(); }
+    void eraseFront(size_t n) {
+        own();
+        owned_.erase(owned_.begin(), owned_.begin() + std::min(n, owned_.size()));
+        sync();
+    }
+
+    // Elements owned by someone else, who keeps them alive for as long as this table views them
+    void view(const T *data, size_t size) {
+        owned_.clear();
+        owned_.shrink_to_fit();
+        data_ = data;
+        size_ = size;
+    }
+
+private:
+    bool viewing() const { return data_ != owned_.data(); }
+    void own() {
+        if(viewing()) {
+            owned_.assign(data_, data_ + size_);
+            sync();
+        }
+    }
+    void sync() {
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+
+    std::vector<T> owned_;
+    const T *data_ = nullptr;
+    size_t size_ = 0;
+};
+
 // This class represents a path (or trajectory) that must be followed
 // It is defined by a sequence of points in 3D space
 // That are interpolated using a cubic spline
+//
+// A streaming path holds a window of the anchors only: anchors are appended at the end and
+// evicted from the front. Parameters, anchor and sample indices and arc lengths stay those of
+// the whole route, so they do not move when the window does
 
 class Path {
 
@@ -15,13 +85,64 @@ public:
     ~Path();
     void addPoint(const double p[9]);
     void getPoint(double p[3], double t) const;
+    // Batch evaluation of count parameters into x, y and z arrays
+    void getPoints(double *x, double *y, double *z, const double *t, int count) const;
     void getAnchor(double p[3], int i) const;
     void getLeftControl(double a[3], int i) const;
     void getRightControl(double a[3], int i) const;
-    int getNumAnchors() const { return points_.size(); }
+    // Anchors and curve samples held are [getFirstAnchor(), getNumAnchors()) and
+    // [getFirstPoint(), getNumPoints()), both 0 unless anchors were evicted
+    int getFirstAnchor() const { return first_anchor_; }
+    int getNumAnchors() const { return first_anchor_ + points_.size(); }
     int getNumSegments() const { return n_segments_; }
-    std::vector<double> getCurve() const;
+    // Read-only view of the sampled curve held (x, y, z per point), owned by the path
+    std::span<const double> getCurve() const { return {curve_.data(), curve_.size()}; }
+    int getFirstPoint() const { return first_anchor_ * (n_segments_ + 1); }
+    int getNumPoints() const { return getFirstPoint() + curve_.size() / 3; }
+    const double *getCurvePoint(int i) const { return &curve_[(i - getFirstPoint()) * 3]; }
+    int getSampleIndex(double t) const;
 	int loadFromFile(std::string &path);
+    // A .route file, or a CSV through the .route beside it when that one is at least as new
+    int load(const std::string &file);
+    // Binary route: anchors plus the sampled curve and every table buildIndex makes. Loading maps
+    // the file and reads the tables in place, only the anchors are copied. A file sampled with
+    // other samples per segment than this path is rejected
+    int saveBinary(const std::string &file) const;
+    int loadBinary(const std::string &file);
+    // Parses one CSV line of 9 values starting at c, leaving c after it. False on a bad value
+    static bool parseAnchor(const char *&c, const char *end, double p[9]);
+
+    // Drops the anchors before anchor, keeping at least the last segment. Call buildIndex after
+    void evictBefore(int anchor);
+
+    // Closest point q on the path to p, with parameter t restricted to [t_min, t_max]
+    // Returns the distance to q, and adds the Newton iterations spent to iterations when given
+    double project(double q[3], double *t, const double p[3], double t_min, double t_max,
+                   int *iterations = nullptr) const;
+    // Local search from t_guess for warm starts, q may be a local minimum only
+    double refine(double q[3], double *t, const double p[3], double t_guess, double t_min, double t_max,
+                  int *iterations = nullptr) const;
+    // True when no point with parameter in [t_min, t_max] is closer to p than dist. Conservative,
+    // it may answer false for pieces that only come near dist. Certifies a local search
+    bool noneCloser(const double p[3], double dist, double t_min, double t_max) const;
+    void buildIndex();
+
+    // Analytic derivatives with respect to t
+    void getDerivatives(double d1[3], double d2[3], double t) const;
+    void getTangent(double d[3], double t) const;
+    // Batch getTangent into x, y and z arrays
+    void getTangents(double *x, double *y, double *z, const double *t, int count) const;
+    double getCurvature(double t) const;
+
+    // Arc-length parameterisation, tables are built by buildIndex. Lengths are measured from the
+    // start of the route, getStartLength() is where the anchors held begin
+    double getLength() const { return arc_length_.empty() ? 0 : arc_length_.back(); }
+    double getStartLength() const { return first_length_; }
+    double getArcLength(double t) const;
+    double getParameter(double s) const;
+    void getPointAt(double p[3], double s) const { getPoint(p, getParameter(s)); }
+    void getTangentAt(double d[3], double s) const { getTangent(d, getParameter(s)); }
+    double getCurvatureAt(double s) const { return getCurvature(getParameter(s)); }
 
 private:
     class Point {
@@ -32,9 +153,39 @@ private:
         double bx, by, bz;
     };
     static void lerp(double p[3], const double p0[3], const double p1[3], double t) ;
+    double projectWindow(double q[3], double *t, const double p[3], double t_min, double t_max,
+                         int *iterations) const;
+    double projectSegment(double q[3], double *u, const double p[3], int segment, double u_min, double u_max,
+                          int *iterations) const;
+    void evalSegment(double b[3], double d1[3], double d2[3], int segment, double u) const;
+    double boundsDistance(const double p[3], int segment) const;
+    void buildArcLength();
+    void locate(int *segment, double *u, double t) const;
     std::vector<Point> points_;
     unsigned int n_segments_;
-    std::vector<double> curve_;
+    int first_anchor_ = 0;     // Route index of points_[0]
+    double first_length_ = 0;  // Arc length at first_anchor_
+    PathTable<double> curve_;
+
+    // Power basis coefficients c0 + c1 u + c2 u^2 + c3 u^3 per segment, as coef_[axis][degree][segment]
+    PathTable<double> coef_[3][4];
+
+    // Arc length at t = j / arc_resolution_, and t at uniform arc length steps of arc_step_
+    static constexpr int arc_resolution_ = 64;
+    PathTable<double> arc_length_;
+    double arc_step_ = 0.05;
+    PathTable<double> arc_parameter_;
+
+    // Spatial index: per segment bounding box (min xyz, max xyz) and a uniform xy grid of segment ids
+    PathTable<double> bounds_;
+    double grid_origin_[2] = {0, 0};
+    double grid_cell_ = 1;
+    int grid_nx_ = 0, grid_ny_ = 0;
+    PathTable<int> grid_start_;
+    PathTable<int> grid_segments_;
+
+    // Route file the tables view after loadBinary, shared by copies of the path
+    std::shared_ptr<const void> mapping_;
 
 };
 
@@ -0,0 +1,220 @@
+#include "path_field.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include <unistd.h>
+
+#include "path.h"
+
+namespace {
+
+//   char[4] "BCPF", uint32 version, uint64 hash, int32 nx, int32 ny, float64 cell, float64 origin[2],
+//   then (nx + 1) * (ny + 1) nodes of 7 float64, row by row
+constexpr uint32_t kFieldVersion = 1;
+
+// Largest grid built, about 110 MB of nodes
+constexpr int kMaxNodes = 2 << 20;
+
+// Closest points of four neighbouring nodes lie within this many cells of arc length of each
+// other, unless the path folds between them. A point at distance d inside a bend of radius r
+// moves r / (r - d) times faster than its projection, the margin keeps that under 2 over a diagonal
+constexpr double kFoldCells = 4;
+
+void hashBytes(uint64_t *h, const void *data, size_t size)
+{
+    // FNV-1a
+    const unsigned char *c = static_cast<const unsigned char *>(data);
+    for(size_t i = 0; i < size; i++) {
+        *h ^= c[i];
+        *h *= 0x100000001b3ull;
+    }
+}
+
+} // namespace
+
+uint64_t PathField::hash(const Path &path, double cell, double margin)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    const int header[3] = {(int)kFieldVersion, path.getNumSegments(), path.getFirstAnchor()};
+    hashBytes(&h, header, sizeof(header));
+    hashBytes(&h, &cell, sizeof(cell));
+    hashBytes(&h, &margin, sizeof(margin));
+    for(int i = path.getFirstAnchor(); i < path.getNumAnchors(); i++) {
+        double p[9];
+        path.getAnchor(p, i);
+        path.getLeftControl(p + 3, i);
+        path.getRightControl(p + 6, i);
+        hashBytes(&h, p, sizeof(p));
+    }
+    return h;
+}
+
+std::shared_ptr<PathField> PathField::build(const Path &path, double cell, double margin)
+{
+    std::span<const double> curve = path.getCurve();
+    if(curve.empty() || cell <= 0)
+        return nullptr;
+    double lo[2] = {curve[0], curve[1]}, hi[2] = {curve[0], curve[1]};
+    double z_mean = 0;
+    for(size_t i = 0; i < curve.size(); i += 3) {
+        for(int k = 0; k < 2; k++) {
+            lo[k] = std::min(lo[k], curve[i + k]);
+            hi[k] = std::max(hi[k], curve[i + k]);
+        }
+        z_mean += curve[i + 2];
+    }
+    z_mean /= curve.size() / 3;
+
+    auto field = std::make_shared<PathField>();
+    field->hash_ = hash(path, cell, margin);
+    field->cell_ = cell;
+    field->origin_[0] = lo[0] - margin;
+    field->origin_[1] = lo[1] - margin;
+    field->nx_ = (int)std::ceil((hi[0] - lo[0] + 2 * margin) / cell);
+    field->ny_ = (int)std::ceil((hi[1] - lo[1] + 2 * margin) / cell);
+    if((double)(field->nx_ + 1) * (field->ny_ + 1) > kMaxNodes) {
+        std::cerr << "Path field of " << field->nx_ << "x" << field->ny_ << " cells is too large, use a larger cell"
+                  << std::endl;
+        return nullptr;
+    }
+
+    const double t_min = path.getFirstAnchor(), t_max = path.getNumAnchors() - 1;
+    const double s_start = path.getArcLength(t_min), s_end = path.getArcLength(t_max);
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    field->nodes_.resize(field->getNumNodes());
+    for(int j = 0; j <= field->ny_; j++) {
+        for(int i = 0; i <= field->nx_; i++) {
+            Node &node = field->nodes_[j * (field->nx_ + 1) + i];
+            node = {nan, 0, 0, 0, {0, 0, 0}};
+
+            // Horizontal closest point: project at the mean height, then again at the height found
+            double p[3] = {field->origin_[0] + i * cell, field->origin_[1] + j * cell, z_mean}, q[3], t;
+            path.project(q, &t, p, t_min, t_max);
+            p[2] = q[2];
+            path.project(q, &t, p, t_min, t_max);
+            const double dx = p[0] - q[0], dy = p[1] - q[1];
+            const double distance = std::sqrt(dx * dx + dy * dy);
+            // Past the ends the closest point is an end, where the signed distance does not blend
+            const double s = path.getArcLength(t);
+            if(distance > margin || s - s_start < cell || s_end - s < cell)
+                continue;
+
+            path.getTangent(node.tangent, t);
+            const double side = node.tangent[0] * dy - node.tangent[1] * dx;
+            node.lateral = side < 0 ? -distance : distance;
+            node.z = q[2];
+            node.t = t;
+            node.s = s;
+        }
+    }
+    return field;
+}
+
+std::shared_ptr<PathField> PathField::open(const Path &path, const std::string &file, double cell, double margin)
+{
+    auto field = std::make_shared<PathField>();
+    if(field->load(file, hash(path, cell, margin)) == 0)
+        return field;
+    field = build(path, cell, margin);
+    if(field && field->save(file) == 0)
+        std::cerr << "Path field of " << field->getNumNodes() << " nodes written to " << file << std::endl;
+    return field;
+}
+
+int PathField::save(const std::string &file) const
+{
+    // Written beside the target and renamed, under a name unique per process and call since other
+    // runs may build the same field meanwhile
+    static std::atomic<unsigned int> calls = 0;
+    std::string temporary = file + "." + std::to_string(getpid()) + "_" + std::to_string(calls++) + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    const int32_t size[2] = {nx_, ny_};
+    out.write("BCPF", 4);
+    out.write(reinterpret_cast<const char *>(&kFieldVersion), sizeof(kFieldVersion));
+    out.write(reinterpret_cast<const char *>(&hash_), sizeof(hash_));
+    out.write(reinterpret_cast<const char *>(size), sizeof(size));
+    out.write(reinterpret_cast<const char *>(&cell_), sizeof(cell_));
+    out.write(reinterpret_cast<const char *>(origin_), sizeof(origin_));
+    out.write(reinterpret_cast<const char *>(nodes_.data()), nodes_.size() * sizeof(Node));
+    out.close();
+    std::error_code error;
+    if(!out.good() || (std::filesystem::rename(temporary, file, error), error)) {
+        std::filesystem::remove(temporary, error);
+        std::cerr << "Unable to write path field " << file << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int PathField::load(const std::string &file, uint64_t hash)
+{
+    std::ifstream in(file, std::ios::binary);
+    char magic[4];
+    uint32_t version;
+    uint64_t file_hash;
+    int32_t size[2];
+    in.read(magic, 4);
+    in.read(reinterpret_cast<char *>(&version), sizeof(version));
+    in.read(reinterpret_cast<char *>(&file_hash), sizeof(file_hash));
+    in.read(reinterpret_cast<char *>(size), sizeof(size));
+    in.read(reinterpret_cast<char *>(&cell_), sizeof(cell_));
+    in.read(reinterpret_cast<char *>(origin_), sizeof(origin_));
+    if(!in.good() || std::memcmp(magic, "BCPF", 4) != 0 || version != kFieldVersion || file_hash != hash ||
+       size[0] < 1 || size[1] < 1 || (double)(size[0] + 1) * (size[1] + 1) > kMaxNodes)
+        return 1;
+    hash_ = file_hash;
+    nx_ = size[0];
+    ny_ = size[1];
+    nodes_.resize(getNumNodes());
+    in.read(reinterpret_cast<char *>(nodes_.data()), nodes_.size() * sizeof(Node));
+    return in.good() ? 0 : 1;
+}
+
+bool PathField::lookup(const double p[3], double *distance, double *t, double tangent[3]) const
+{
+    const double gx = (p[0] - origin_[0]) / cell_, gy = (p[1] - origin_[1]) / cell_;
+    if(!(gx >= 0 && gy >= 0 && gx < nx_ && gy < ny_))
+        return false;
+    const int i = (int)gx, j = (int)gy;
+    const double fx = gx - i, fy = gy - j;
+    const Node *corner[4] = {&node(i, j), &node(i + 1, j), &node(i, j + 1), &node(i + 1, j + 1)};
+    const double weight[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+
+    double s_min = corner[0]->s, s_max = corner[0]->s, lateral = 0;
+    for(const Node *n : corner) {
+        if(std::isnan(n->lateral))
+            return false;
+        s_min = std::min(s_min, n->s);
+        s_max = std::max(s_max, n->s);
+    }
+    if(s_max - s_min > kFoldCells * cell_)
+        return false;
+
+    double z = 0;
+    *t = 0;
+    tangent[0] = tangent[1] = tangent[2] = 0;
+    for(int k = 0; k < 4; k++) {
+        const Node &n = *corner[k];
+        lateral += weight[k] * n.lateral;
+        z += weight[k] * n.z;
+        *t += weight[k] * n.t;
+        for(int a = 0; a < 3; a++)
+            tangent[a] += weight[k] * n.tangent[a];
+    }
+    const double norm = std::sqrt(tangent[0] * tangent[0] + tangent[1] * tangent[1] + tangent[2] * tangent[2]);
+    if(norm > 1e-12)
+        for(int a = 0; a < 3; a++)
+            tangent[a] /= norm;
+    // Height off the closest point, less the part along a sloped tangent, which the 3D closest
+    // point absorbs by moving along the path
+    const double dz = p[2] - z;
+    *distance = std::sqrt(lateral * lateral + dz * dz * std::max(1 - tangent[2] * tangent[2], 0.0));
+    return true;
+}
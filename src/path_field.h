@@ -0,0 +1,62 @@
+#ifndef PATH_FIELD_H
+#define PATH_FIELD_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Path;
+
+// Closest point of a path precomputed on an xy grid, so a lookup is a bilinear blend of four
+// nodes instead of a search
+//
+// Each node holds the signed horizontal distance to the path (left of the tangent is positive),
+// the height, parameter, arc length and unit tangent at its closest point. The signed distance
+// is smooth across the path, so it blends well where the tracking error is small. Nodes farther
+// than the margin, or whose closest point is an end of the path, are left out; a lookup touching
+// one of them, or four nodes whose closest points are far apart on the path (a fold, e.g. where
+// the path passes by itself), fails and the caller projects exactly instead.
+
+class PathField {
+
+public:
+    // Samples the path every cell meters over its xy bounds grown by margin. nullptr when the
+    // grid would be too large
+    static std::shared_ptr<PathField> build(const Path &path, double cell, double margin);
+    // Field of path from file, or built and written there when the file is missing or was made
+    // for another path or spacing
+    static std::shared_ptr<PathField> open(const Path &path, const std::string &file, double cell, double margin);
+    // Identifies the anchors, sampling and spacing a field was built from
+    static uint64_t hash(const Path &path, double cell, double margin);
+
+    int save(const std::string &file) const;
+    // Fails unless the file was written for hash
+    int load(const std::string &file, uint64_t hash);
+
+    // Distance from p to the path, with the parameter and unit tangent of the closest point.
+    // False when p is outside the field or near a node left out
+    bool lookup(const double p[3], double *distance, double *t, double tangent[3]) const;
+
+    uint64_t getHash() const { return hash_; }
+    double getCell() const { return cell_; }
+    int getNumNodes() const { return (nx_ + 1) * (ny_ + 1); }
+
+private:
+    struct Node {
+        double lateral; // NaN when the node is left out
+        double z;
+        double t;
+        double s;
+        double tangent[3];
+    };
+    const Node &node(int i, int j) const { return nodes_[j * (nx_ + 1) + i]; }
+
+    uint64_t hash_ = 0;
+    double cell_ = 1;
+    double origin_[2] = {0, 0};
+    int nx_ = 0, ny_ = 0; // Cells, the nodes are one more in each direction
+    std::vector<Node> nodes_;
+};
+
+#endif //PATH_FIELD_H
@@ -0,0 +1,267 @@
+#include "mjpc/tasks/bicycle/reduced_rider.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include <mujoco/mujoco.h>
+
+#include "mjpc/tasks/bicycle/runner.h"
+
+namespace mjpc
+{
+    namespace
+    {
+        int JointSize(int type, bool velocity)
+        {
+            switch (type)
+            {
+            case mjJNT_FREE:
+                return velocity ? 6 : 7;
+            case mjJNT_BALL:
+                return velocity ? 3 : 4;
+            default:
+                return 1;
+            }
+        }
+
+        int RequireId(const mjModel *model, mjtObj type, const char *name)
+        {
+            int id = mj_name2id(model, type, name);
+            if (id < 0)
+                mju_error("ReducedRider: %s not found", name);
+            return id;
+        }
+
+        int JointDof(const mjModel *model, const char *name)
+        {
+            return model->jnt_dofadr[RequireId(model, mjOBJ_JOINT, name)];
+        }
+    } // namespace
+
+    mjModel *LoadPlanningModel(const mjModel *full, const std::string &scene, const std::string &task_file,
+                               char *error, int error_size)
+    {
+        mjModel *reduced = LoadBicycleModel(scene, error, error_size, task_file);
+        if (!reduced)
+            return nullptr;
+
+        // The task keeps the sensor addresses of the model it was reset with
+        const char *mismatch = nullptr;
+        if (reduced->nsensor != full->nsensor || reduced->nsensordata != full->nsensordata)
+            mismatch = "sensors";
+        for (int i = 0; i < full->nsensor && !mismatch; i++)
+        {
+            const char *name = mj_id2name(full, mjOBJ_SENSOR, i);
+            const char *other = mj_id2name(reduced, mjOBJ_SENSOR, i);
+            if (!name != !other || (name && std::string(name) != other) ||
+                reduced->sensor_type[i] != full->sensor_type[i] || reduced->sensor_dim[i] != full->sensor_dim[i] ||
+                reduced->sensor_adr[i] != full->sensor_adr[i])
+                mismatch = "sensors";
+        }
+        if (!mismatch && reduced->nmocap != full->nmocap)
+            mismatch = "mocap bodies";
+        for (const char *motor : {"crank", "steer", "lean"})
+        {
+            int id = mj_name2id(reduced, mjOBJ_ACTUATOR, motor);
+            if (!mismatch && (id < 0 || reduced->actuator_trntype[id] != mjTRN_JOINT))
+                mismatch = "motors";
+        }
+        if (mismatch)
+        {
+            std::snprintf(error, error_size, "%s: %s differ from task.xml", task_file.c_str(), mismatch);
+            mj_deleteModel(reduced);
+            return nullptr;
+        }
+        return reduced;
+    }
+
+    SynergyBasis::SynergyBasis(const mjModel *model) : model_(model)
+    {
+        dofs_[kCrank] = JointDof(model, "crank_joint");
+        dofs_[kSteer] = JointDof(model, "steering_joint");
+        dofs_[kLean] = JointDof(model, "abdomen_x");
+        const char *sides[2] = {"left", "right"};
+        for (int k = 0; k < 2; k++)
+        {
+            const std::string side = sides[k];
+            pedal_sites_[k] = RequireId(model, mjOBJ_SITE, (side + "_pedal_site").c_str());
+            foot_sites_[k] = RequireId(model, mjOBJ_SITE, (side + "_foot_site").c_str());
+            grip_sites_[k] = RequireId(model, mjOBJ_SITE, (side + "_steering_site").c_str());
+            hand_sites_[k] = RequireId(model, mjOBJ_SITE, (side + "_hand_site").c_str());
+        }
+
+        // A model without the motors lists their joints and limits, see Apply
+        const std::string prefix = "synergy_motor_";
+        for (int i = 0; i < model->nnumeric; i++)
+        {
+            const char *name = mj_id2name(model, mjOBJ_NUMERIC, i);
+            if (name && std::string_view(name).starts_with(prefix))
+                joint_motors_.push_back({JointDof(model, name + prefix.size()),
+                                         std::abs(model->numeric_data[model->numeric_adr[i]])});
+        }
+    }
+
+    bool SynergyBasis::Find(const mjModel *model, int actuators[kSynergies])
+    {
+        const char *names[kSynergies] = {"crank", "steer", "lean"};
+        for (int k = 0; k < kSynergies; k++)
+        {
+            actuators[k] = mj_name2id(model, mjOBJ_ACTUATOR, names[k]);
+            if (actuators[k] < 0 || model->actuator_trntype[actuators[k]] != mjTRN_JOINT ||
+                model->actuator_gainprm[actuators[k] * mjNGAIN] != 0)
+                return false;
+        }
+        return true;
+    }
+
+    void SynergyBasis::Expand(mjData *data, const double torque[kSynergies], double *ctrl) const
+    {
+        mj_markStack(data);
+        const mjtNum *qfrc = Torques(data, torque);
+
+        // Motors are the joint actuators with a gain, the synergies have none
+        for (int a = 0; a < model_->nu; a++)
+        {
+            const double gear = model_->actuator_gear[6 * a];
+            if (model_->actuator_trntype[a] != mjTRN_JOINT || model_->actuator_gainprm[a * mjNGAIN] == 0 ||
+                std::abs(gear) < mjMINVAL)
+                continue;
+            double value = qfrc[model_->jnt_dofadr[model_->actuator_trnid[2 * a]]] / gear;
+            if (model_->actuator_ctrllimited[a])
+                value = std::clamp(value, model_->actuator_ctrlrange[2 * a], model_->actuator_ctrlrange[2 * a + 1]);
+            ctrl[a] = value;
+        }
+        mj_freeStack(data);
+    }
+
+    void SynergyBasis::Apply(mjData *data, const double torque[kSynergies]) const
+    {
+        mj_markStack(data);
+        const mjtNum *qfrc = Torques(data, torque);
+        for (const JointMotor &motor : joint_motors_)
+            data->qfrc_applied[motor.dof] = std::clamp(qfrc[motor.dof], -motor.limit, motor.limit);
+        mj_freeStack(data);
+    }
+
+    mjtNum *SynergyBasis::Torques(mjData *data, const double torque[kSynergies]) const
+    {
+        const int nv = model_->nv;
+        mjtNum *jacobian = mj_stackAllocNum(data, 3 * nv);
+        mjtNum *qfrc = mj_stackAllocNum(data, nv);
+        mju_zero(qfrc, nv);
+        Transmit(data, jacobian, qfrc, torque[kCrank], dofs_[kCrank], pedal_sites_, foot_sites_);
+        Transmit(data, jacobian, qfrc, torque[kSteer], dofs_[kSteer], grip_sites_, hand_sites_);
+        qfrc[dofs_[kLean]] += torque[kLean];
+        return qfrc;
+    }
+
+    void SynergyBasis::Transmit(const mjData *data, mjtNum *jacobian, mjtNum *qfrc, double torque, int dof,
+                                const int drive_sites[2], const int rider_sites[2]) const
+    {
+        // Column dof of the drive site Jacobians: how each site moves per unit of joint rotation.
+        // Forces f along it with g.f = torque, least norm: f = torque g / |g|^2
+        const int nv = model_->nv;
+        double g[6];
+        for (int k = 0; k < 2; k++)
+        {
+            mj_jacSite(model_, data, jacobian, nullptr, drive_sites[k]);
+            for (int r = 0; r < 3; r++)
+                g[3 * k + r] = jacobian[r * nv + dof];
+        }
+        const double norm2 = mju_dot(g, g, 6);
+        if (norm2 < mjMINVAL)
+            return;
+
+        // The rider pushes with f at its own sites: J^T f, which is zero off the limbs involved
+        for (int k = 0; k < 2; k++)
+        {
+            double f[3];
+            mju_scl3(f, g + 3 * k, torque / norm2);
+            mj_jacSite(model_, data, jacobian, nullptr, rider_sites[k]);
+            for (int v = 0; v < nv; v++)
+                qfrc[v] += jacobian[v] * f[0] + jacobian[nv + v] * f[1] + jacobian[2 * nv + v] * f[2];
+        }
+    }
+
+    ReducedRider::ReducedRider(const mjModel *full, const mjModel *reduced)
+        : full_(full), reduced_(reduced), basis_(full)
+    {
+        crank_ = RequireId(reduced, mjOBJ_ACTUATOR, "crank");
+        steer_ = RequireId(reduced, mjOBJ_ACTUATOR, "steer");
+        lean_ = RequireId(reduced, mjOBJ_ACTUATOR, "lean");
+
+        // Every joint of the planning model is a joint of the full model, but the lean of a rigid rider
+        const int lean_joint = reduced->actuator_trnid[2 * lean_];
+        for (int j = 0; j < reduced->njnt; j++)
+        {
+            const char *name = mj_id2name(reduced, mjOBJ_JOINT, j);
+            // The bicycle's freejoint has no name, and is the first joint of every model
+            int f = name ? mj_name2id(full, mjOBJ_JOINT, name) : (j == 0 ? 0 : -1);
+            if (f < 0 && j == lean_joint)
+            {
+                lean_qpos_ = reduced->jnt_qposadr[j];
+                lean_dof_ = reduced->jnt_dofadr[j];
+                continue;
+            }
+            if (f < 0 || full->jnt_type[f] != reduced->jnt_type[j])
+                mju_error("ReducedRider: joint %d of the planning model has no match in the full model", j);
+            joints_.push_back({full->jnt_qposadr[f], full->jnt_dofadr[f], reduced->jnt_qposadr[j],
+                               reduced->jnt_dofadr[j], JointSize(reduced->jnt_type[j], false),
+                               JointSize(reduced->jnt_type[j], true)});
+        }
+        const char *lean_name = mj_id2name(reduced, mjOBJ_JOINT, lean_joint);
+        if (lean_qpos_ < 0 && (!lean_name || std::string(lean_name) != "abdomen_x"))
+            mju_error("ReducedRider: the lean motor drives neither a lean joint nor abdomen_x");
+
+        crank_gear_ = reduced->actuator_gear[6 * crank_];
+        steer_gear_ = reduced->actuator_gear[6 * steer_];
+        lean_gear_ = reduced->actuator_gear[6 * lean_];
+
+        bicycle_body_ = RequireId(full, mjOBJ_BODY, "bicycle");
+        torso_body_ = RequireId(full, mjOBJ_BODY, "torso");
+        seat_site_ = RequireId(full, mjOBJ_SITE, "seat_site");
+    }
+
+    void ReducedRider::MapState(const mjData *full_data, mjData *reduced_data) const
+    {
+        reduced_data->time = full_data->time;
+        for (const JointPair &j : joints_)
+        {
+            mju_copy(reduced_data->qpos + j.reduced_qpos, full_data->qpos + j.full_qpos, j.nq);
+            mju_copy(reduced_data->qvel + j.reduced_dof, full_data->qvel + j.full_dof, j.nv);
+        }
+        mju_copy(reduced_data->mocap_pos, full_data->mocap_pos, 3 * full_->nmocap);
+        mju_copy(reduced_data->mocap_quat, full_data->mocap_quat, 4 * full_->nmocap);
+        if (lean_qpos_ < 0)
+            return;
+
+        // Lean: the torso over the seat in the frame's yz plane, positive to the frame's left
+        const double *frame = full_data->xmat + 9 * bicycle_body_;
+        double offset[3], local[3];
+        mju_sub3(offset, full_data->xpos + 3 * torso_body_, full_data->site_xpos + 3 * seat_site_);
+        mju_mulMatTVec3(local, frame, offset);
+        reduced_data->qpos[lean_qpos_] = std::atan2(-local[1], local[2]);
+
+        // Its rate: angular velocity of the torso relative to the frame, around the frame's x axis
+        double torso[6], bicycle[6], relative[3];
+        mj_objectVelocity(full_, full_data, mjOBJ_BODY, torso_body_, torso, 0);
+        mj_objectVelocity(full_, full_data, mjOBJ_BODY, bicycle_body_, bicycle, 0);
+        mju_sub3(relative, torso, bicycle);
+        mju_mulMatTVec3(local, frame, relative);
+        reduced_data->qvel[lean_dof_] = local[0];
+    }
+
+    void ReducedRider::MapControls(mjData *full_data, const double *reduced_ctrl, double *full_ctrl) const
+    {
+        // abdomen_x turns the pelvis under the upper body; with the pelvis on the seat the upper
+        // body turns the other way. The synergy model drives abdomen_x as planned
+        const double lean = lean_gear_ * reduced_ctrl[lean_];
+        const double torque[SynergyBasis::kSynergies] = {crank_gear_ * reduced_ctrl[crank_],
+                                                         steer_gear_ * reduced_ctrl[steer_],
+                                                         lean_qpos_ >= 0 ? -lean : lean};
+        basis_.Expand(full_data, torque, full_ctrl);
+    }
+} // namespace mjpc
@@ -0,0 +1,124 @@
+#ifndef MJPC_TASKS_BICYCLE_REDUCED_RIDER_H_
+#define MJPC_TASKS_BICYCLE_REDUCED_RIDER_H_
+
+#include <string>
+#include <vector>
+
+#include <mujoco/mujoco.h>
+
+// Planning with three controls (crank, steer and lean) while the physics runs the 21 motors of
+// the humanoid of task.xml. Two planning models have them:
+//   task_reduced.xml  a rigid rider fused to the frame that only leans, much cheaper to step
+//   task_synergy.xml  the full humanoid without its motors, whose torques every step expands
+//                     from the three synergies, in the rollouts too (see Bicycle::ExpandSynergies)
+// They share the bicycle joints and the sensors of task.xml, so the task reads the same addresses
+// from any of them, and include its custom values from task_custom.xml
+
+namespace mjpc
+{
+  // Loads a planning model (task_file of bicycle/experiments) for scene and checks it against
+  // the full model: same sensors at the same addresses, same mocap bodies, and the crank, steer
+  // and lean motors on joints
+  mjModel *LoadPlanningModel(const mjModel *full, const std::string &scene, const std::string &task_file,
+                             char *error, int error_size);
+
+  // Humanoid motor controls that put torques on the crank, the steering and abdomen_x, at the
+  // pose of a model with the humanoid: the ctrl of its motors (task.xml), or the motor torques
+  // themselves for a model that leaves the motors out (task_synergy.xml in rollouts)
+  //
+  // The humanoid holds the pedals and the grips through welds and connects, so a torque on the
+  // crank (or the steering) is produced by the least-norm pair of forces at the two pedal (grip)
+  // sites, and the humanoid pushes with those forces through the transposed Jacobians of its
+  // foot (hand) sites. The abdomen_x torque goes to its own motor. The result is quasi-static:
+  // the humanoid's own inertia and the stiffness of its joints are left to the feedback of the
+  // next planning step
+  class SynergyBasis
+  {
+  public:
+    enum Synergy
+    {
+      kCrank = 0,
+      kSteer,
+      kLean,
+      kSynergies,
+    };
+
+    explicit SynergyBasis(const mjModel *model);
+
+    // Sets the ctrl of every motor, clamped to its range, and leaves the other actuators alone.
+    // data needs the kinematics of the pose, the scratch comes from its stack
+    void Expand(mjData *data, const double torque[kSynergies], double *ctrl) const;
+    // The same torques for a model without the motors: sets the qfrc_applied of each joint that a
+    // synergy_motor_<joint> custom value lists, within that value, and leaves the other dofs alone
+    void Apply(mjData *data, const double torque[kSynergies]) const;
+    // True when the model lists the joints Apply drives
+    bool AppliesMotors() const { return !joint_motors_.empty(); }
+
+    // The crank, steer and lean actuators of a model that plans with synergies: zero gain, so
+    // they apply nothing themselves, on the joints of the torques Expand takes. False when the
+    // model has none
+    static bool Find(const mjModel *model, int actuators[kSynergies]);
+
+  private:
+    struct JointMotor
+    {
+      int dof;
+      double limit; // Largest torque, gear times the control range of the motor
+    };
+
+    // Rider torques of every dof for the synergy torques, on the stack of data, which the caller
+    // marks and frees
+    mjtNum *Torques(mjData *data, const double torque[kSynergies]) const;
+    // Adds to qfrc the rider torques that apply torque on dof through the drive sites
+    void Transmit(const mjData *data, mjtNum *jacobian, mjtNum *qfrc, double torque, int dof,
+                  const int drive_sites[2], const int rider_sites[2]) const;
+
+    const mjModel *model_;
+    int dofs_[kSynergies];
+    int pedal_sites_[2], foot_sites_[2], grip_sites_[2], hand_sites_[2];
+    std::vector<JointMotor> joint_motors_; // Empty for a model with the motors
+  };
+
+  // Maps states of the full model onto a planning model and the three planned controls back onto
+  // the humanoid motors, through a SynergyBasis of the full model at the current pose. The lean
+  // torque of the rigid rider drives abdomen_x, which turns the upper body over the pelvis pinned
+  // to the seat; the synergy model drives abdomen_x itself
+  class ReducedRider
+  {
+  public:
+    ReducedRider(const mjModel *full, const mjModel *reduced);
+    ReducedRider(const ReducedRider &) = delete;
+    ReducedRider &operator=(const ReducedRider &) = delete;
+
+    // Joints of both models, time and mocap copied. A lean joint of the planning model only (the
+    // rigid rider) gets the angle of the torso around the frame's x axis, seen from the seat.
+    // Does not run mj_forward
+    void MapState(const mjData *full_data, mjData *reduced_data) const;
+    // Humanoid controls that put the planned controls on the bicycle, clamped to the control
+    // ranges. full_data needs the kinematics of the state the controls apply to
+    void MapControls(mjData *full_data, const double *reduced_ctrl, double *full_ctrl) const;
+
+  private:
+    struct JointPair
+    {
+      int full_qpos, full_dof;
+      int reduced_qpos, reduced_dof;
+      int nq, nv;
+    };
+
+    const mjModel *full_;
+    const mjModel *reduced_;
+    std::vector<JointPair> joints_;
+    SynergyBasis basis_;
+
+    // Planning model
+    int crank_ = -1, steer_ = -1, lean_ = -1;
+    double crank_gear_ = 0, steer_gear_ = 0, lean_gear_ = 0;
+    int lean_qpos_ = -1, lean_dof_ = -1; // Rigid rider only
+
+    // Full model
+    int bicycle_body_ = -1, torso_body_ = -1, seat_site_ = -1;
+  };
+} // namespace mjpc
+
+#endif // MJPC_TASKS_BICYCLE_REDUCED_RIDER_H_
@@ -0,0 +1,67 @@
+#ifndef MJPC_TASKS_BICYCLE_RESIDUAL_H_
+#define MJPC_TASKS_BICYCLE_RESIDUAL_H_
+
+#include <cstdio>
+
+#include <mujoco/mujoco.h>
+
+namespace mjpc
+{
+  // A residual made of terms written back to back, each term a type with
+  //   static constexpr int kDim;           entries it writes
+  //   static constexpr const char *kName;  for error messages
+  //   static void Compute(const Context &ctx, double *residual);
+  // Offsets are compile-time constants, so Compute inlines into one kernel
+  template <typename Context, typename... Terms>
+  struct ResidualTerms
+  {
+    static_assert(sizeof...(Terms) > 0, "a residual needs at least one term");
+    static constexpr int kDim = (Terms::kDim + ...);
+    static constexpr int kTerms = sizeof...(Terms);
+
+    static void Compute(const Context &ctx, double *residual)
+    {
+      double *r = residual;
+      ((Terms::Compute(ctx, r), r += Terms::kDim), ...);
+    }
+
+    // The user sensors of the model must cover the terms in order, a term may span
+    // several consecutive sensors. Returns false and fills error otherwise
+    static bool Check(const mjModel *model, char *error, int error_size)
+    {
+      static constexpr int dims[] = {Terms::kDim...};
+      static constexpr const char *names[] = {Terms::kName...};
+      int term = 0, filled = 0;
+      for (int i = 0; i < model->nsensor; i++)
+      {
+        if (model->sensor_type[i] != mjSENS_USER)
+          continue;
+        if (term == kTerms)
+        {
+          std::snprintf(error, error_size, "more user sensors than the %d residual entries", kDim);
+          return false;
+        }
+        filled += model->sensor_dim[i];
+        if (filled > dims[term])
+        {
+          std::snprintf(error, error_size, "user sensor %s crosses the end of term %s (%d entries)",
+                        mj_id2name(model, mjOBJ_SENSOR, i), names[term], dims[term]);
+          return false;
+        }
+        if (filled == dims[term])
+        {
+          term++;
+          filled = 0;
+        }
+      }
+      if (term != kTerms)
+      {
+        std::snprintf(error, error_size, "user sensors end inside term %s", names[term]);
+        return false;
+      }
+      return true;
+    }
+  };
+} // namespace mjpc
+
+#endif // MJPC_TASKS_BICYCLE_RESIDUAL_H_
@@ -0,0 +1,83 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded single-producer/single-consumer queue of fixed-size records
+//
+// One thread may call push, one other thread may call pop. Neither blocks or
+// allocates: a push into a full ring is refused and counted as dropped. The
+// capacity is rounded up to a power of two.
+
+template <typename T>
+class SpscRing {
+
+public:
+    explicit SpscRing(size_t capacity) {
+        _capacity = 1;
+        while (_capacity < capacity)
+            _capacity <<= 1;
+        _mask = _capacity - 1;
+        _slots = std::make_unique<T[]>(_capacity);
+    }
+
+    // Producer side, returns false when the ring is full
+    bool push(const T &value) {
+        const uint64_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail_cache >= _capacity) {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+            if (head - _tail_cache >= _capacity) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        _slots[head & _mask] = value;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side, true when a push would be refused
+    bool full() const {
+        return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_acquire) >= _capacity;
+    }
+
+    // Consumer side, returns false when the ring is empty
+    bool pop(T &value) {
+        const uint64_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head_cache) {
+            _head_cache = _head.load(std::memory_order_acquire);
+            if (tail == _head_cache)
+                return false;
+        }
+        value = _slots[tail & _mask];
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return _capacity; }
+
+    // Counters, safe to read from any thread
+    uint64_t pushed() const { return _head.load(std::memory_order_acquire); }
+    uint64_t popped() const { return _tail.load(std::memory_order_acquire); }
+    uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t kLine = 64;
+
+    size_t _capacity;
+    size_t _mask;
+    std::unique_ptr<T[]> _slots;
+
+    // Producer and consumer indices live on separate cache lines, each with a
+    // private copy of the other side's index to avoid touching it on every call
+    alignas(kLine) std::atomic<uint64_t> _head = 0;
+    uint64_t _tail_cache = 0;
+    alignas(kLine) std::atomic<uint64_t> _tail = 0;
+    uint64_t _head_cache = 0;
+    alignas(kLine) std::atomic<uint64_t> _dropped = 0;
+};
+
+#endif //RING_BUFFER_H
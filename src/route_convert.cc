@@ -0,0 +1,68 @@
+// Converts path CSV files to binary routes (see Path::saveBinary), writing each one
+// next to its CSV with the .route extension, and reports the load time of both
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_split.h>
+
+#include "mjpc/utilities.h"
+#include "path.h"
+
+ABSL_FLAG(std::string, scenes, "straight,zigzag,track,stairs,rough",
+          "Comma separated scenes whose path.csv is converted, in addition to the CSV files given as arguments");
+ABSL_FLAG(int, samples, 50, "Curve samples per segment stored in the route");
+
+namespace
+{
+    double Seconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool Convert(const std::string &csv, int samples)
+    {
+        std::string route = std::filesystem::path(csv).replace_extension(".route").string();
+
+        auto start = std::chrono::steady_clock::now();
+        Path path(samples);
+        std::string file = csv;
+        if (path.loadFromFile(file) != 0 || path.saveBinary(route) != 0)
+            return false;
+        double csv_time = Seconds(start);
+
+        start = std::chrono::steady_clock::now();
+        Path check(samples);
+        if (check.loadBinary(route) != 0)
+            return false;
+        double route_time = Seconds(start);
+        if (check.getNumAnchors() != path.getNumAnchors() || check.getNumPoints() != path.getNumPoints())
+        {
+            std::fprintf(stderr, "%s does not read back\n", route.c_str());
+            return false;
+        }
+
+        std::printf("%s: %d anchors, %.2f m, csv %.3f ms, route %.3f ms\n", route.c_str(), path.getNumAnchors(),
+                    path.getLength(), csv_time * 1e3, route_time * 1e3);
+        return true;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::vector<char *> args = absl::ParseCommandLine(argc, argv);
+    std::vector<std::string> files(args.begin() + 1, args.end());
+    std::vector<std::string> scenes = absl::StrSplit(absl::GetFlag(FLAGS_scenes), ',', absl::SkipWhitespace());
+    for (const std::string &scene : scenes)
+        files.push_back(mjpc::GetModelPath("bicycle/experiments/" + scene + "/path.csv"));
+
+    int failed = 0;
+    for (const std::string &file : files)
+        failed += !Convert(file, absl::GetFlag(FLAGS_samples));
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+#include "route_stream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#include "path.h"
+
+int CsvTailSource::read(RouteAnchor *out, int max)
+{
+    // Pick up whatever was appended since the last call; a stream at EOF needs its state cleared
+    if (!_in.is_open()) {
+        _in.open(_file, std::ios::binary);
+        if (!_in.is_open())
+            return 0;
+    }
+    _in.clear();
+    char buffer[4096];
+    while (_in.read(buffer, sizeof(buffer)) || _in.gcount() > 0)
+        _pending.append(buffer, _in.gcount());
+
+    int count = 0;
+    while (count < max) {
+        size_t newline = _pending.find('\n', _parsed);
+        if (newline == std::string::npos)
+            break;
+        const char *c = _pending.data() + _parsed;
+        const char *end = _pending.data() + newline;
+        _parsed = newline + 1;
+        _line++;
+        while (c < end && (*c == ' ' || *c == '\t' || *c == '\r'))
+            c++;
+        if (c == end)
+            continue;
+        // A bad line is reported and skipped, the stream goes on with the next one
+        if (Path::parseAnchor(c, end, out[count].p))
+            count++;
+        else
+            std::cerr << "Bad value on line " << _line << " of " << _file << std::endl;
+    }
+    if (_parsed > _pending.size() / 2) {
+        _pending.erase(0, _parsed);
+        _parsed = 0;
+    }
+    return count;
+}
+
+GeneratedSource::GeneratedSource(uint32_t seed, int64_t count, double spacing, double max_turn)
+    : _random(seed), _count(count), _spacing(spacing), _max_turn(max_turn)
+{
+}
+
+int GeneratedSource::read(RouteAnchor *out, int max)
+{
+    // Height of the track site over flat ground, as in the flat scenes
+    const double height = 0.913957953453064;
+    std::uniform_real_distribution<double> turn(-_max_turn, _max_turn);
+
+    int count = 0;
+    while (count < max && !finished()) {
+        if (_produced > 0) {
+            _heading += turn(_random);
+            _position[0] += _spacing * std::cos(_heading);
+            _position[1] += _spacing * std::sin(_heading);
+        }
+        // Controls a third of the spacing along the heading, so the curve stays smooth at anchors
+        const double dx = _spacing / 3 * std::cos(_heading), dy = _spacing / 3 * std::sin(_heading);
+        const double x = _position[0], y = _position[1];
+        const double p[9] = {x, y, height, x - dx, y - dy, height, x + dx, y + dy, height};
+        std::copy(p, p + 9, out[count].p);
+        count++;
+        _produced++;
+    }
+    return count;
+}
+
+RouteStream::RouteStream(std::unique_ptr<RouteSource> source, size_t capacity)
+    : _source(std::move(source)), _ring(capacity)
+{
+    _thread = std::thread(&RouteStream::produce, this);
+}
+
+RouteStream::~RouteStream()
+{
+    _stop.store(true, std::memory_order_release);
+    _thread.join();
+}
+
+void RouteStream::produce()
+{
+    RouteAnchor batch[16];
+    int size = 0, next = 0;
+    while (!_stop.load(std::memory_order_acquire)) {
+        if (next == size) {
+            next = 0;
+            size = _source->read(batch, 16);
+            if (size == 0) {
+                if (_source->finished()) {
+                    _finished.store(true, std::memory_order_release);
+                    return;
+                }
+                // Nothing new in the file yet
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                continue;
+            }
+        }
+        while (next < size && _ring.push(batch[next]))
+            next++;
+        if (next < size)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+bool RouteStream::wait(RouteAnchor &anchor, double timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+    while (!pop(anchor)) {
+        if (finished() || std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+std::unique_ptr<RouteStream> RouteStream::open(const std::string &spec, std::string *error)
+{
+    const std::string tail = "tail:", generate = "generate:";
+    if (spec.starts_with(tail))
+        return std::make_unique<RouteStream>(std::make_unique<CsvTailSource>(spec.substr(tail.size())));
+    if (spec.starts_with(generate)) {
+        const char *c = spec.c_str() + generate.size();
+        char *end;
+        unsigned long seed = std::strtoul(c, &end, 10);
+        long long count = -1;
+        if (end != c && *end == ':') {
+            c = end + 1;
+            count = std::strtoll(c, &end, 10);
+        }
+        if (end == c || *end != '\0') {
+            *error = "expected generate:<seed>[:<anchors>], got " + spec;
+            return nullptr;
+        }
+        return std::make_unique<RouteStream>(std::make_unique<GeneratedSource>((uint32_t)seed, count));
+    }
+    *error = "unknown route stream " + spec;
+    return nullptr;
+}
@@ -0,0 +1,100 @@
+#ifndef ROUTE_STREAM_H
+#define ROUTE_STREAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "ring_buffer.h"
+
+// Anchors of a route that arrives over time
+//
+// A RouteSource produces anchors (9 doubles: point, left and right control, as in the
+// path CSV). A RouteStream runs one on its own thread and queues the anchors in a ring,
+// so the task only pops what is already there and never waits on the producer.
+
+struct RouteAnchor {
+    double p[9];
+};
+
+class RouteSource {
+
+public:
+    virtual ~RouteSource() = default;
+    // Writes up to max anchors to out and returns how many, 0 when none is ready yet
+    virtual int read(RouteAnchor *out, int max) = 0;
+    // True once read will never return an anchor again
+    virtual bool finished() const { return false; }
+};
+
+// Follows a CSV that another process keeps appending to. Only complete lines are read
+class CsvTailSource : public RouteSource {
+
+public:
+    explicit CsvTailSource(const std::string &file) : _file(file) {}
+    int read(RouteAnchor *out, int max) override;
+
+private:
+    std::string _file;
+    std::ifstream _in;
+    std::string _pending; // Bytes read but not yet parsed, ends with a partial line
+    size_t _parsed = 0;
+    int _line = 0; // Lines parsed so far, for the error messages
+};
+
+// Procedural course on flat ground: anchors every spacing meters, the heading drifting by a
+// bounded random turn at each one. Seeded, so every episode gets the same course
+class GeneratedSource : public RouteSource {
+
+public:
+    // count < 0 never ends
+    GeneratedSource(uint32_t seed, int64_t count, double spacing = 10, double max_turn = 0.3);
+    int read(RouteAnchor *out, int max) override;
+    bool finished() const override { return _count >= 0 && _produced >= _count; }
+
+private:
+    std::mt19937 _random;
+    int64_t _count;
+    int64_t _produced = 0;
+    double _spacing;
+    double _max_turn;
+    double _position[2] = {0, 0};
+    double _heading = 0;
+};
+
+class RouteStream {
+
+public:
+    explicit RouteStream(std::unique_ptr<RouteSource> source, size_t capacity = 256);
+    ~RouteStream();
+
+    RouteStream(const RouteStream &) = delete;
+    RouteStream &operator=(const RouteStream &) = delete;
+
+    // Consumer side, one thread at a time. False when no anchor is queued
+    bool pop(RouteAnchor &anchor) { return _ring.pop(anchor); }
+    // Consumer side, waits up to timeout seconds for an anchor
+    bool wait(RouteAnchor &anchor, double timeout);
+    // The source ended and every anchor was popped
+    bool finished() const {
+        return _finished.load(std::memory_order_acquire) && _ring.popped() == _ring.pushed();
+    }
+
+    // "tail:<csv file>" or "generate:<seed>[:<anchors>]", nullptr with error set otherwise
+    static std::unique_ptr<RouteStream> open(const std::string &spec, std::string *error);
+
+private:
+    void produce();
+
+    std::unique_ptr<RouteSource> _source;
+    SpscRing<RouteAnchor> _ring;
+    std::atomic<bool> _stop = false;
+    std::atomic<bool> _finished = false;
+    std::thread _thread;
+};
+
+#endif //ROUTE_STREAM_H
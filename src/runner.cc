@@ -0,0 +1,305 @@
+#include "mjpc/tasks/bicycle/runner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+
+#include <mujoco/mujoco.h>
+
+#include "mjpc/agent.h"
+#include "mjpc/planners/sampling/planner.h"
+#include "mjpc/utilities.h"
+
+namespace mjpc
+{
+    std::string BicycleScenePath(const std::string &scene, const std::string &file)
+    {
+        return GetModelPath("bicycle/experiments/" + scene + "/" + file);
+    }
+
+    mjModel *LoadBicycleModel(const std::string &scene, char *error, int error_size,
+                              const std::string &task_file)
+    {
+        std::string task_path = GetModelPath("bicycle/experiments/" + task_file);
+        std::ifstream file(task_path);
+        if (!file.is_open())
+        {
+            std::snprintf(error, error_size, "Unable to open file %s", task_path.c_str());
+            return nullptr;
+        }
+        std::stringstream xml;
+        xml << file.rdbuf();
+
+        // Swap the scene include, and load from a sibling file so relative includes still resolve.
+        // The file name is unique per process and call, other runs may load the same scene meanwhile
+        static const unsigned int process = std::random_device{}();
+        static std::atomic<unsigned int> calls = 0;
+        std::regex include("experiments/[^/\"]+/scene.xml");
+        std::string task = std::regex_replace(xml.str(), include, "experiments/" + scene + "/scene.xml");
+        std::filesystem::path scene_path = std::filesystem::path(task_path).replace_filename(
+            "." + std::filesystem::path(task_file).stem().string() + "_" + scene + "_" + std::to_string(process) +
+            "_" + std::to_string(calls++) + ".xml");
+        std::ofstream(scene_path) << task;
+        mjModel *model = mj_loadXML(scene_path.c_str(), nullptr, error, error_size);
+        std::filesystem::remove(scene_path);
+        return model;
+    }
+
+    bool ApplyOverrides(mjModel *model, const std::vector<ModelOverride> &overrides,
+                        char *error, int error_size)
+    {
+        const std::string weight = "weight:";
+        for (const ModelOverride &o : overrides)
+        {
+            if (o.name.starts_with(weight))
+            {
+                std::string sensor = o.name.substr(weight.size());
+                int id = mj_name2id(model, mjOBJ_SENSOR, sensor.c_str());
+                if (id < 0 || model->sensor_type[id] != mjSENS_USER || model->nuser_sensor < 2)
+                {
+                    std::snprintf(error, error_size, "%s: user sensor not found", sensor.c_str());
+                    return false;
+                }
+                // User sensor data is norm, weight, weight range...
+                model->sensor_user[id * model->nuser_sensor + 1] = o.value;
+            }
+            else
+            {
+                int id = mj_name2id(model, mjOBJ_NUMERIC, o.name.c_str());
+                if (id < 0 || model->numeric_size[id] < 1)
+                {
+                    std::snprintf(error, error_size, "%s: numeric not found", o.name.c_str());
+                    return false;
+                }
+                model->numeric_data[model->numeric_adr[id]] = o.value;
+            }
+        }
+        return true;
+    }
+
+    void InitializeAgent(Agent *agent, const mjModel *model, std::shared_ptr<Bicycle> task)
+    {
+        agent->SetTaskList({task});
+        agent->gui_task_id = 0;
+        agent->Initialize(model);
+        agent->Allocate();
+        agent->Reset();
+        agent->plan_enabled = true;
+        agent->action_enabled = true;
+    }
+
+    void ResetToHome(const mjModel *model, mjData *data)
+    {
+        int home = mj_name2id(model, mjOBJ_KEY, "home");
+        if (home >= 0)
+            mj_resetDataKeyframe(model, data, home);
+        else
+            mj_resetData(model, data);
+        mj_forward(model, data);
+    }
+
+    EpisodeResult RunEpisode(mjModel *model, std::shared_ptr<Bicycle> task,
+                             ThreadPool *pool, double max_time, const StepCallback &on_step)
+    {
+        EpisodeRunner runner(model, task, pool);
+        return runner.Run(max_time, on_step);
+    }
+
+    EpisodeRunner::EpisodeRunner(mjModel *model, std::shared_ptr<Bicycle> task, ThreadPool *pool,
+                                 const mjModel *planning_model)
+        : model_(model), planning_model_(planning_model ? planning_model : model), task_(task), pool_(pool)
+    {
+        InitializeAgent(&agent_, planning_model_, task);
+        data_ = mj_makeData(model);
+        ResetToHome(model, data_);
+        if (planning_model)
+        {
+            planning_data_ = mj_makeData(planning_model);
+            ResetToHome(planning_model, planning_data_);
+            rider_ = std::make_unique<ReducedRider>(model, planning_model);
+        }
+    }
+
+    EpisodeRunner::~EpisodeRunner()
+    {
+        mj_deleteData(data_);
+        if (planning_data_)
+            mj_deleteData(planning_data_);
+    }
+
+    void EpisodeRunner::Reset()
+    {
+        // A new horizon reaches the agent and the task lookahead only through initialization
+        if (budget_ && budget_->ApplyPending())
+        {
+            InitializeAgent(&agent_, planning_model_, task_);
+        }
+        else
+        {
+            task_->Reset(planning_model_);
+            agent_.Reset();
+        }
+        ResetToHome(model_, data_);
+        steps_ = 0;
+        plan_time_ = 0;
+    }
+
+    bool EpisodeRunner::Step(double max_time, const StepCallback &on_step)
+    {
+        if (task_->episode_end != Bicycle::kEpisodeRunning || data_->time >= max_time)
+            return false;
+        ApplyBudget();
+
+        // The planner sees exactly the state the physics is at, one iteration per step
+        auto start = std::chrono::steady_clock::now();
+        if (rider_)
+        {
+            rider_->MapState(data_, planning_data_);
+            mj_forward(planning_model_, planning_data_);
+            agent_.ActiveState().Set(planning_model_, planning_data_);
+        }
+        else
+        {
+            agent_.ActiveState().Set(model_, data_);
+        }
+        agent_.PlanIteration(pool_);
+        const double plan_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        plan_time_ += plan_time;
+        task_->CountPlannerIteration();
+        if (budget_ && budget_->Record(plan_time, data_->time))
+            SetTrajectories(budget_->trajectories());
+        if (rider_)
+        {
+            agent_.ActivePlanner().ActionFromPolicy(planning_data_->ctrl, agent_.ActiveState().state().data(),
+                                                    data_->time);
+            rider_->MapControls(data_, planning_data_->ctrl, data_->ctrl);
+        }
+        else
+        {
+            agent_.ActivePlanner().ActionFromPolicy(data_->ctrl, agent_.ActiveState().state().data(), data_->time);
+        }
+        agent_.ActiveTask()->Transition(model_, data_);
+        if (on_step)
+            on_step(model_, data_);
+        mj_step(model_, data_);
+        steps_++;
+        return true;
+    }
+
+    EpisodeResult EpisodeRunner::Run(double max_time, const StepCallback &on_step)
+    {
+        while (Step(max_time, on_step))
+        {
+        }
+
+        task_->FlushTelemetry();
+        EpisodeResult result;
+        result.end = task_->episode_end;
+        result.trajectory_error = task_->metrics->getTrajectoryError();
+        result.trajectory_time = task_->metrics->getTrajectoryTime();
+        result.success_rate = task_->metrics->getSuccessRate();
+        result.sim_time = data_->time;
+        result.steps = steps_;
+        result.plan_time = plan_time_;
+        return result;
+    }
+
+    void EpisodeRunner::SetBudget(const BudgetConfig &config)
+    {
+        budget_ = std::make_unique<PlannerBudget>(config, planning_model_);
+        planning_model_ = budget_->model();
+        SetTrajectories(budget_->trajectories());
+    }
+
+    void EpisodeRunner::ApplyBudget()
+    {
+        // Initializing the agent resets the task, which restarts a streaming route
+        if (!budget_ || !budget_->pending() || task_->streamsRoute())
+            return;
+        Bicycle::Snapshot task;
+        task_->SaveSnapshot(&task);
+        auto *sampling = dynamic_cast<SamplingPlanner *>(&agent_.ActivePlanner());
+        SamplingPolicy policy;
+        if (sampling)
+            policy = sampling->policy;
+
+        budget_->ApplyPending();
+        InitializeAgent(&agent_, planning_model_, task_);
+        task_->RestoreSnapshot(task, true);
+
+        // The controls of the spline points both policies have carry over, points added past the
+        // old horizon hold its last controls; the next iteration resamples them over the new one
+        sampling = dynamic_cast<SamplingPlanner *>(&agent_.ActivePlanner());
+        if (!sampling || policy.num_spline_points < 1)
+            return;
+        SamplingPolicy &to = sampling->policy;
+        const int nu = planning_model_->nu;
+        const int kept = std::min(policy.num_spline_points, to.num_spline_points);
+        const double spacing = kept > 1 ? policy.times[1] - policy.times[0] : 0;
+        for (int i = 0; i < to.num_spline_points; i++)
+        {
+            const int from = std::min(i, kept - 1);
+            to.times[i] = policy.times[from] + (i - from) * spacing;
+            std::copy_n(policy.parameters.begin() + from * nu, nu, to.parameters.begin() + i * nu);
+        }
+    }
+
+    void EpisodeRunner::SetTrajectories(int trajectories)
+    {
+        // Only the sampling planner has a sample count; the others just get the horizon
+        auto *sampling = dynamic_cast<SamplingPlanner *>(&agent_.ActivePlanner());
+        if (sampling)
+            sampling->num_trajectory_ = trajectories;
+    }
+
+    void EpisodeRunner::Save(Snapshot *snapshot) const
+    {
+        if (!snapshot->data)
+            snapshot->data.reset(mj_makeData(model_));
+        mj_copyData(snapshot->data.get(), model_, data_);
+        task_->SaveSnapshot(&snapshot->task);
+        auto *sampling = dynamic_cast<SamplingPlanner *>(&agent_.ActivePlanner());
+        snapshot->has_policy = sampling != nullptr;
+        if (sampling)
+            snapshot->policy = sampling->policy;
+        snapshot->steps = steps_;
+        snapshot->plan_time = plan_time_;
+    }
+
+    void EpisodeRunner::Restore(const Snapshot &snapshot)
+    {
+        if (!snapshot.data)
+            mju_error("EpisodeRunner: restoring a snapshot that was never saved");
+        mj_copyData(data_, model_, snapshot.data.get());
+        task_->RestoreSnapshot(snapshot.task);
+        // Other planners keep the policy they had, which only delays convergence a little
+        auto *sampling = dynamic_cast<SamplingPlanner *>(&agent_.ActivePlanner());
+        if (sampling && snapshot.has_policy)
+            sampling->policy = snapshot.policy;
+        steps_ = snapshot.steps;
+        plan_time_ = snapshot.plan_time;
+    }
+
+    void PrintEpisodeHeader()
+    {
+        std::printf("scene,planning_model,end,trajectory_error,trajectory_time,success_rate,sim_time,steps,"
+                    "plan_ms\n");
+    }
+
+    void PrintEpisode(const EpisodeResult &result)
+    {
+        const char *end[] = {"max_time", "timeout", "goal", "fall"};
+        // Planner wall time per step, in milliseconds
+        const double plan_ms = result.steps > 0 ? 1e3 * result.plan_time / result.steps : 0;
+        std::printf("%s,%s,%s,%e,%e,%e,%e,%d,%.3f\n", result.scene.c_str(), result.planning_model.c_str(),
+                    end[result.end], result.trajectory_error, result.trajectory_time, result.success_rate,
+                    result.sim_time, result.steps, plan_ms);
+    }
+} // namespace mjpc
@@ -0,0 +1,138 @@
+#ifndef MJPC_TASKS_BICYCLE_RUNNER_H_
+#define MJPC_TASKS_BICYCLE_RUNNER_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <mujoco/mujoco.h>
+
+#include "mjpc/agent.h"
+#include "mjpc/planners/sampling/policy.h"
+#include "mjpc/tasks/bicycle/bicycle.h"
+#include "mjpc/tasks/bicycle/budget.h"
+#include "mjpc/tasks/bicycle/reduced_rider.h"
+#include "mjpc/threadpool.h"
+
+// Helpers to run Bicycle episodes without the GUI: the agent plans and the
+// physics steps in the same loop, and every time is in simulation seconds
+
+namespace mjpc
+{
+  // Files of a scene under bicycle/experiments
+  std::string BicycleScenePath(const std::string &scene, const std::string &file);
+
+  // Loads task.xml, or another task file of bicycle/experiments, with its scene include
+  // replaced by the given scene
+  mjModel *LoadBicycleModel(const std::string &scene, char *error, int error_size,
+                            const std::string &task_file = "task.xml");
+
+  // A value set on a copy of the model before an episode: the first element of a
+  // custom numeric (e.g. "residual_Speed Goal", "sampling_trajectories"), or the
+  // weight of a user sensor when the name is "weight:<sensor>"
+  struct ModelOverride
+  {
+    std::string name;
+    double value = 0;
+  };
+
+  // Returns false and fills error when a name does not exist in the model
+  bool ApplyOverrides(mjModel *model, const std::vector<ModelOverride> &overrides,
+                      char *error, int error_size);
+
+  struct EpisodeResult
+  {
+    std::string scene;
+    std::string planning_model = "full";
+    Bicycle::EpisodeEnd end = Bicycle::kEpisodeRunning; // Running means max_time was hit
+    double trajectory_error = 0;
+    double trajectory_time = 0;
+    double success_rate = 0;
+    double sim_time = 0;
+    int steps = 0;
+    double plan_time = 0; // Wall seconds in planner iterations, over all the steps
+  };
+
+  // Sets the task as the only one of the agent and enables planning and actions
+  void InitializeAgent(Agent *agent, const mjModel *model, std::shared_ptr<Bicycle> task);
+
+  // Resets data to the "home" keyframe (or the default state) and runs mj_forward
+  void ResetToHome(const mjModel *model, mjData *data);
+
+  // Called after the transition and before mj_step, with data as the planner saw it
+  using StepCallback = std::function<void(const mjModel *, const mjData *)>;
+
+  // Runs one episode from the "home" keyframe until the task ends or max_time
+  EpisodeResult RunEpisode(mjModel *model, std::shared_ptr<Bicycle> task,
+                           ThreadPool *pool, double max_time,
+                           const StepCallback &on_step = nullptr);
+
+  // An agent and an mjData kept across episodes. Resetting reuses both, and a snapshot taken
+  // at any step can be restored any number of times to branch episodes from a shared prefix
+  //
+  // With a planning model (see LoadPlanningModel) the agent plans on it: each step maps the
+  // state of model onto it and its controls back onto the humanoid, and the task is reset with
+  // the planning model
+  class EpisodeRunner
+  {
+  public:
+    EpisodeRunner(mjModel *model, std::shared_ptr<Bicycle> task, ThreadPool *pool,
+                  const mjModel *planning_model = nullptr);
+    ~EpisodeRunner();
+    EpisodeRunner(const EpisodeRunner &) = delete;
+    EpisodeRunner &operator=(const EpisodeRunner &) = delete;
+
+    // Back to the "home" keyframe with a reset task and planner
+    void Reset();
+    // One planner iteration and one physics step. False, without stepping, once the
+    // episode ended or the simulation time reached max_time
+    bool Step(double max_time, const StepCallback &on_step = nullptr);
+    // Steps until the end and reports the whole episode, including any restored prefix
+    EpisodeResult Run(double max_time, const StepCallback &on_step = nullptr);
+
+    // Adapts the planner to a deadline from the next step on. The sample count follows it as it
+    // goes; a horizon and spline point change initializes the agent again at the next step,
+    // carrying the task and the policy over. With a streaming route, which would restart, it
+    // waits for the next Reset instead
+    void SetBudget(const BudgetConfig &config);
+    const PlannerBudget *budget() const { return budget_.get(); }
+
+    struct Snapshot
+    {
+      std::unique_ptr<mjData, void (*)(mjData *)> data{nullptr, mj_deleteData};
+      Bicycle::Snapshot task;
+      SamplingPolicy policy; // Warm start, kept for the sampling planner only
+      bool has_policy = false;
+      int steps = 0;
+      double plan_time = 0;
+    };
+    // Copies the state into snapshot, allocating its mjData on the first save
+    void Save(Snapshot *snapshot) const;
+    void Restore(const Snapshot &snapshot);
+
+    const mjData *data() const { return data_; }
+    Bicycle *task() const { return task_.get(); }
+
+  private:
+    void SetTrajectories(int trajectories);
+    void ApplyBudget();
+
+    mjModel *model_;
+    const mjModel *planning_model_; // model_ unless planning with another model or a budget
+    std::shared_ptr<Bicycle> task_;
+    ThreadPool *pool_;
+    Agent agent_;
+    mjData *data_;
+    mjData *planning_data_ = nullptr;
+    std::unique_ptr<ReducedRider> rider_;
+    std::unique_ptr<PlannerBudget> budget_;
+    int steps_ = 0;
+    double plan_time_ = 0;
+  };
+
+  void PrintEpisodeHeader();
+  void PrintEpisode(const EpisodeResult &result);
+} // namespace mjpc
+
+#endif // MJPC_TASKS_BICYCLE_RUNNER_H_
@@ -0,0 +1,145 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+// Counters and timers of the task hot paths
+//
+// They are compiled in only when MJPC_BICYCLE_STATS is defined; otherwise every
+// method below is an empty inline function and the timers hold no clock. Each
+// thread adds into its own cache line, so the planner threads calling the
+// residual do not contend; reading sums the lines.
+
+enum StatCounter {
+    kStatResidualCalls = 0,
+    kStatActionNs,          // Time in the action term
+    kStatPathPositionNs,    // Time in the path position term, including the projection
+    kStatPathVelocityNs,    // Time in the path velocity term
+    kStatProjections,       // Closest point searches
+    kStatProjectionIters,   // Newton iterations over all of them
+    kStatProjectionWarm,    // Searches warm-started from the previous state of a rollout
+    kStatFieldLookups,      // Path field lookups of the Field path target
+    kStatFieldMisses,       // Lookups that fell back to a search
+    kStatTerminalStates,    // Rollout states scored with the terminal residual, after a fall or past the distance
+    kStatTerminalRollouts,  // Rollouts that reached such a state
+    kStatTransitions,
+    kStatTransitionNs,      // Time TransitionLocked holds the task lock
+    kStatMaxGeomHits,       // Geoms ModifyScene skipped because the scene was full
+    kStatPlannerIterations, // Counted by runners that drive the planner themselves
+    kStatCount,
+};
+
+// A copy of the counters at one point in time
+struct StatsSnapshot {
+    uint64_t value[kStatCount] = {};
+
+    uint64_t operator[](StatCounter c) const { return value[c]; }
+
+    // Residual calls per planner iteration, or per transition when nobody counts iterations
+    double residualsPerIteration() const {
+        uint64_t per = value[kStatPlannerIterations] ? value[kStatPlannerIterations] : value[kStatTransitions];
+        return per ? (double)value[kStatResidualCalls] / per : 0;
+    }
+
+    double meanNs(StatCounter timer, StatCounter calls) const {
+        return value[calls] ? (double)value[timer] / value[calls] : 0;
+    }
+
+    StatsSnapshot operator-(const StatsSnapshot &other) const {
+        StatsSnapshot d;
+        for (int c = 0; c < kStatCount; c++)
+            d.value[c] = value[c] - other.value[c];
+        return d;
+    }
+
+    void print(FILE *f) const {
+        fprintf(f, "stats: residuals %llu (%.1f per iteration), action %.0f ns, path position %.0f ns, "
+                   "path velocity %.0f ns, projections %llu (%.2f iterations, %llu warm), "
+                   "field lookups %llu (%llu missed), terminal states %llu (%.1f%%) in %llu rollouts, "
+                   "transitions %llu (%.0f ns), max geom %llu\n",
+                (unsigned long long)value[kStatResidualCalls], residualsPerIteration(),
+                meanNs(kStatActionNs, kStatResidualCalls), meanNs(kStatPathPositionNs, kStatResidualCalls),
+                meanNs(kStatPathVelocityNs, kStatResidualCalls),
+                (unsigned long long)value[kStatProjections], meanNs(kStatProjectionIters, kStatProjections),
+                (unsigned long long)value[kStatProjectionWarm],
+                (unsigned long long)value[kStatFieldLookups], (unsigned long long)value[kStatFieldMisses],
+                (unsigned long long)value[kStatTerminalStates],
+                value[kStatResidualCalls] ? 100.0 * value[kStatTerminalStates] / value[kStatResidualCalls] : 0.0,
+                (unsigned long long)value[kStatTerminalRollouts],
+                (unsigned long long)value[kStatTransitions], meanNs(kStatTransitionNs, kStatTransitions),
+                (unsigned long long)value[kStatMaxGeomHits]);
+    }
+};
+
+#ifdef MJPC_BICYCLE_STATS
+
+class TaskStats {
+
+public:
+    static constexpr bool kEnabled = true;
+
+    void add(StatCounter c, uint64_t n = 1) {
+        _slots[slot()].value[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    StatsSnapshot snapshot() const {
+        StatsSnapshot s;
+        for (const Slot &slot : _slots)
+            for (int c = 0; c < kStatCount; c++)
+                s.value[c] += slot.value[c].load(std::memory_order_relaxed);
+        return s;
+    }
+
+    // Adds the time from construction to destruction to a timer counter
+    class Timer {
+    public:
+        Timer(TaskStats &stats, StatCounter c) : _stats(stats), _counter(c), _start(std::chrono::steady_clock::now()) {}
+        ~Timer() {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start);
+            _stats.add(_counter, ns.count());
+        }
+    private:
+        TaskStats &_stats;
+        StatCounter _counter;
+        std::chrono::steady_clock::time_point _start;
+    };
+
+private:
+    static constexpr int kSlots = 64;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> value[kStatCount] = {};
+    };
+
+    // Threads get consecutive slots; past kSlots they share, which is still correct
+    static int slot() {
+        static std::atomic<int> next = 0;
+        thread_local int slot = next.fetch_add(1, std::memory_order_relaxed) % kSlots;
+        return slot;
+    }
+
+    Slot _slots[kSlots];
+};
+
+#else
+
+class TaskStats {
+
+public:
+    static constexpr bool kEnabled = false;
+
+    void add(StatCounter, uint64_t = 1) {}
+    StatsSnapshot snapshot() const { return {}; }
+
+    class Timer {
+    public:
+        Timer(TaskStats &, StatCounter) {}
+    };
+};
+
+#endif
+
+#endif //STATS_H
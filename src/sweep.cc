@@ -0,0 +1,175 @@
+// Runs a grid of Bicycle episodes over scenes and model overrides in parallel,
+// printing one CSV table with a row per episode
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_split.h>
+#include <mujoco/mujoco.h>
+
+#include "mjpc/tasks/bicycle/bicycle.h"
+#include "mjpc/tasks/bicycle/runner.h"
+#include "mjpc/threadpool.h"
+#include "mjpc/utilities.h"
+
+ABSL_FLAG(std::string, output_file, "", "Unused, each episode writes to --output_dir");
+ABSL_FLAG(std::string, output_dir, ".", "Directory for the time series of each episode");
+ABSL_FLAG(std::string, scenes, "straight,zigzag,track,stairs,rough", "Comma separated scenes");
+ABSL_FLAG(std::string, grid, "",
+          "Semicolon separated axes of the form name=v1,v2,... where name is a custom numeric "
+          "(\"residual_Speed Goal\", \"sampling_trajectories\", ...) or weight:<user sensor>");
+ABSL_FLAG(int, episodes, 1, "Episodes per grid cell");
+ABSL_FLAG(double, max_time, 120, "Simulation seconds before an episode is cut off");
+ABSL_FLAG(int, workers, 0, "Episodes run in parallel, 0 for one per planner thread group");
+ABSL_FLAG(int, planner_threads, 1, "Planner threads of each episode");
+
+namespace
+{
+    struct Axis
+    {
+        std::string name;
+        std::vector<double> values;
+    };
+
+    struct Job
+    {
+        std::string scene;
+        std::vector<mjpc::ModelOverride> overrides;
+        int episode;
+    };
+
+    std::vector<Axis> ParseGrid(const std::string &grid)
+    {
+        std::vector<Axis> axes;
+        std::vector<std::string> specs = absl::StrSplit(grid, ';', absl::SkipWhitespace());
+        for (const std::string &spec : specs)
+        {
+            std::vector<std::string> parts = absl::StrSplit(spec, absl::MaxSplits('=', 1));
+            if (parts.size() != 2)
+                mju_error("Bad grid axis %s", spec.c_str());
+            Axis axis{parts[0], {}};
+            std::vector<std::string> values = absl::StrSplit(parts[1], ',', absl::SkipWhitespace());
+            for (const std::string &value : values)
+                axis.values.push_back(std::strtod(value.c_str(), nullptr));
+            axes.push_back(axis);
+        }
+        return axes;
+    }
+
+    // Cartesian product of the scenes, every axis and the episode index
+    std::vector<Job> MakeJobs(const std::vector<std::string> &scenes, const std::vector<Axis> &axes, int episodes)
+    {
+        std::vector<Job> jobs;
+        for (const std::string &scene : scenes)
+        {
+            std::vector<size_t> index(axes.size(), 0);
+            while (true)
+            {
+                std::vector<mjpc::ModelOverride> overrides;
+                for (size_t a = 0; a < axes.size(); a++)
+                    overrides.push_back({axes[a].name, axes[a].values[index[a]]});
+                for (int e = 0; e < episodes; e++)
+                    jobs.push_back({scene, overrides, e});
+
+                size_t a = 0;
+                for (; a < axes.size(); a++)
+                {
+                    if (++index[a] < axes[a].values.size())
+                        break;
+                    index[a] = 0;
+                }
+                if (a == axes.size())
+                    break;
+            }
+        }
+        return jobs;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    absl::ParseCommandLine(argc, argv);
+    std::vector<std::string> scenes = absl::StrSplit(absl::GetFlag(FLAGS_scenes), ',', absl::SkipWhitespace());
+    std::vector<Axis> axes = ParseGrid(absl::GetFlag(FLAGS_grid));
+    std::vector<Job> jobs = MakeJobs(scenes, axes, absl::GetFlag(FLAGS_episodes));
+
+    // Compile every scene once, workers copy the compiled model and apply their overrides
+    char error[1024] = "";
+    std::map<std::string, mjModel *> models;
+    for (const std::string &scene : scenes)
+    {
+        mjModel *model = mjpc::LoadBicycleModel(scene, error, sizeof(error));
+        if (!model)
+        {
+            std::fprintf(stderr, "Failed to load scene %s: %s\n", scene.c_str(), error);
+            return 1;
+        }
+        models[scene] = model;
+
+        mjModel *check = mj_copyModel(nullptr, model);
+        bool valid = jobs.empty() || mjpc::ApplyOverrides(check, jobs[0].overrides, error, sizeof(error));
+        mj_deleteModel(check);
+        if (!valid)
+        {
+            std::fprintf(stderr, "Bad grid for scene %s: %s\n", scene.c_str(), error);
+            return 1;
+        }
+    }
+
+    int planner_threads = std::max(absl::GetFlag(FLAGS_planner_threads), 1);
+    int workers = absl::GetFlag(FLAGS_workers);
+    if (workers <= 0)
+        workers = std::max(mjpc::NumAvailableHardwareThreads() / planner_threads, 1);
+
+    std::vector<mjpc::EpisodeResult> results(jobs.size());
+    std::atomic<int> next = 0;
+    std::vector<std::thread> threads;
+    for (int w = 0; w < workers; w++)
+    {
+        threads.emplace_back([&]() {
+            mjpc::ThreadPool pool(planner_threads);
+            for (int j = next++; j < (int)jobs.size(); j = next++)
+            {
+                const Job &job = jobs[j];
+                mjModel *model = mj_copyModel(nullptr, models.at(job.scene));
+                mjpc::ApplyOverrides(model, job.overrides, nullptr, 0);
+
+                std::string output = absl::GetFlag(FLAGS_output_dir) + "/" + job.scene + "_" + std::to_string(j) + ".bin";
+                auto task = std::make_shared<mjpc::Bicycle>("", output);
+                task->print_metrics = false;
+                results[j] = mjpc::RunEpisode(model, task, &pool, absl::GetFlag(FLAGS_max_time));
+                results[j].scene = job.scene;
+                mj_deleteModel(model);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    std::printf("job,episode");
+    for (const Axis &axis : axes)
+        std::printf(",%s", axis.name.c_str());
+    std::printf(",");
+    mjpc::PrintEpisodeHeader();
+    for (size_t j = 0; j < jobs.size(); j++)
+    {
+        std::printf("%zu,%d", j, jobs[j].episode);
+        for (const mjpc::ModelOverride &o : jobs[j].overrides)
+            std::printf(",%g", o.value);
+        std::printf(",");
+        mjpc::PrintEpisode(results[j]);
+    }
+
+    for (auto &[scene, model] : models)
+        mj_deleteModel(model);
+    return 0;
+}
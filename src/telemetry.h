@@ -0,0 +1,128 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Streaming, columnar writer for time series of doubles
+//
+// All integers are little-endian. The file starts with a header:
+//   char[4]  magic "BCTS"
+//   uint32   version (1)
+//   uint8    codec (0 raw, 1 xor-delta)
+//   uint32   rows per full chunk
+//   uint32   number of columns, then for each column:
+//            uint16 name length, name bytes, uint8 dtype (1 = float64)
+// followed by any number of chunks, each flushed to the stream as soon as it is full:
+//   char[4]  magic "CHNK"
+//   uint32   episode
+//   uint32   rows
+//   per column: uint32 byte size, then the encoded values
+// Raw values are 8 bytes each. Xor-delta stores the first value raw, then for each
+// value x = bits ^ previous bits as one byte n (leading zero bytes of x, 0..8)
+// followed by the 8 - n low bytes of x, which is compact for smooth signals.
+// A run that is cut short loses at most the rows of the chunk being filled.
+
+class TelemetryWriter {
+
+public:
+    enum Codec : uint8_t { kRaw = 0, kXorDelta = 1 };
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint8_t kFloat64 = 1;
+
+    TelemetryWriter(std::ostream &os, const std::vector<std::string> &columns, uint32_t chunk_rows = 1024,
+                    Codec codec = kXorDelta)
+        : _os(os), _columns(columns.size()), _chunk_rows(chunk_rows), _codec(codec) {
+        _buffer.resize(_columns * _chunk_rows);
+        _encoded.resize(_chunk_rows * 9);
+
+        _os.write("BCTS", 4);
+        put(kVersion, 4);
+        put(_codec, 1);
+        put(_chunk_rows, 4);
+        put(_columns, 4);
+        for (const std::string &name : columns) {
+            put(name.size(), 2);
+            _os.write(name.data(), name.size());
+            put(kFloat64, 1);
+        }
+        _os.flush();
+    }
+
+    ~TelemetryWriter() { flush(); }
+
+    // Appends one value per column, writing a chunk when it is full
+    void append(const double *row) {
+        for (size_t c = 0; c < _columns; c++)
+            _buffer[c * _chunk_rows + _rows] = row[c];
+        if (++_rows == _chunk_rows)
+            flush();
+    }
+
+    // Rows appended after this belong to the given episode
+    void setEpisode(uint32_t episode) {
+        flush();
+        _episode = episode;
+    }
+
+    void flush() {
+        if (_rows == 0)
+            return;
+        _os.write("CHNK", 4);
+        put(_episode, 4);
+        put(_rows, 4);
+        for (size_t c = 0; c < _columns; c++) {
+            size_t size = encode(&_buffer[c * _chunk_rows]);
+            put(size, 4);
+            _os.write(_encoded.data(), size);
+        }
+        _os.flush();
+        _total_rows += _rows;
+        _rows = 0;
+    }
+
+    uint64_t rows() const { return _total_rows + _rows; }
+
+private:
+    void put(uint64_t value, int bytes) {
+        char b[8];
+        for (int i = 0; i < bytes; i++)
+            b[i] = static_cast<char>(value >> (8 * i));
+        _os.write(b, bytes);
+    }
+
+    size_t encode(const double *values) {
+        char *out = _encoded.data();
+        uint64_t prev = 0;
+        for (uint32_t i = 0; i < _rows; i++) {
+            uint64_t bits;
+            std::memcpy(&bits, &values[i], 8);
+            uint64_t x = (_codec == kXorDelta && i > 0) ? bits ^ prev : bits;
+            prev = bits;
+            int n = 0;
+            if (_codec == kXorDelta && i > 0) {
+                while (n < 8 && (x >> (56 - 8 * n)) == 0)
+                    n++;
+                *out++ = static_cast<char>(n);
+            }
+            for (int b = 0; b < 8 - n; b++)
+                *out++ = static_cast<char>(x >> (8 * b));
+        }
+        return out - _encoded.data();
+    }
+
+    std::ostream &_os;
+    size_t _columns;
+    uint32_t _chunk_rows;
+    Codec _codec;
+    uint32_t _episode = 0;
+    uint32_t _rows = 0;
+    uint64_t _total_rows = 0;
+    std::vector<double> _buffer;  // column-major, _chunk_rows per column
+    std::vector<char> _encoded;
+};
+
+#endif //TELEMETRY_H